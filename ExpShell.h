@@ -0,0 +1,257 @@
+// ==========================
+// ExpShell.h
+// Parser and executor of ExpShell as a library (libexpshell).
+// Everything a command line can change lives in a session,
+// so a program can keep one around and run many lines on it.
+// ==========================
+
+#ifndef EXPSHELL_H
+#define EXPSHELL_H
+
+#include <map>
+#include <string>
+#include <sys/resource.h>
+#include <vector>
+
+// how a command line is connected, -1 keeps the fd of the host process
+struct io_spec {
+  int in_fd;
+  int out_fd;
+  int err_fd;
+  bool capture; // collect stdout and stderr into the result instead
+  io_spec() : in_fd(-1), out_fd(-1), err_fd(-1), capture(false) {}
+};
+
+// what running a command line gives back
+struct run_result {
+  int status;         // exit code, like $? of sh
+  std::string output; // stdout, if captured
+  std::string error;  // stderr, if captured
+  rusage usage;       // of the processes run for the line
+};
+
+// a background job, a line ending with &
+// with a jobserver, each job needs a token from it before being spawned
+struct job {
+  int id;
+  int pid; // 0 while waiting for a token
+  int pid_fd; // to wait for it beside a foreground line, -1 without pidfd
+  std::string line;
+  bool has_token;      // took a token from the jobserver
+  bool implicit_token; // runs on the shell's own token instead
+};
+
+// a command looked up in PATH, see session::hash_command
+struct hashed_command {
+  std::string path;
+  int fd; // O_PATH fd of the binary, -1 if not among the hottest
+  unsigned long long dev, ino;
+  long uses;
+  long last_use;
+};
+
+// what the runs of a line cost, see set -o profile
+struct line_profile {
+  std::string line;
+  long runs;
+  double wall, cpu; // seconds
+  long processes;
+  line_profile() : runs(0), wall(0), cpu(0), processes(0) {}
+};
+
+class cmd;
+class pipe_cmd;
+struct stage_counts;
+
+class session {
+public:
+  session();
+  ~session();
+
+  // run a command line as if it was typed at the prompt
+  run_result run(const std::string &line, const io_spec &io = io_spec());
+
+  // ==========================
+  // state of the shell
+  // ==========================
+  // record home directory for `cd` and `cd ~`, see home()
+  std::string home_dir;
+  // command alias, loaded by the first command run
+  std::map<std::string, std::string> alias_map;
+  bool alias_loaded;
+  // history, not kept for scripts and -c
+  std::vector<std::string> cmd_history;
+  bool keep_history;
+  // shell options, set by `set -o name[=value]` and cleared by `set +o name`
+  // pin - pin pipeline stages to cache-sharing neighbour cpus
+  // jobs=N - act as a make jobserver with N job slots
+  // maxload=F - hold back jobs while 1-minute load per cpu exceeds F
+  // maxpressure=P - hold back jobs while cpu or memory PSI avg10 exceeds P%
+  // cache_env=A,B - environment variables that are part of the `cached` key
+  // cache_dir=DIR - store of `cached`, ~/.expshell/cache by default
+  // incremental[=DB] - skip redirect commands whose output is up to date
+  // io=uring|rw - how builtin stages move data, read/write by default
+  // state[=FILE] - save hash, aliases and history for the next shell
+  // profile[=FILE] - report the cost of each line at exit, to stderr by default
+  // trace=FILE - write the processes run as a Chrome trace at exit
+  // agents=DIR - sockets of the servers `remote` runs commands on
+  // agent_pick=rr|load - round robin over agents or the least busy one
+  std::map<std::string, std::string> shell_options;
+  // set by `quit`
+  bool finished;
+  // the process ends after the next line, whose last command may replace it
+  bool exec_last;
+  // working directory, entered for each line
+  std::string cwd;
+  // variables set by the session, in the environment only while it runs
+  std::map<std::string, std::string> env_vars;
+  void set_env(const std::string &name, const std::string &value);
+  void unset_env(const std::string &name);
+  void apply_env();
+  // where the line being run is read from, like script:12, if from a file
+  std::string source;
+  // background jobs, and what happened to them since last asked
+  std::vector<job> job_table;
+  std::vector<std::string> job_notices;
+
+  // ==========================
+  // builtin commands, run by the session itself
+  // ==========================
+  const std::string &home();
+  void init_alias();
+  bool option_on(const std::string &name);
+  bool reports_at_exit();
+  bool uring_io();
+  int process_builtin_command(std::string line);
+  int builtin_time(std::string line);
+  int builtin_set(std::string line);
+  int builtin_jobs(std::string line);
+  int builtin_dag(std::string line);
+  int builtin_read(std::string line);
+  int builtin_hash(std::string line);
+
+  // ==========================
+  // execution, in forked children unless noted
+  // ==========================
+  int execute_line(std::string line, rusage &usage,
+                   bool tail = false); // in the session
+  int exec_line(const std::string &line);
+  int run_subshell(const std::string &body, rusage &usage); // in the session
+  bool run_lastpipe(const std::string &line, int &status);  // in the session
+  int run_line(std::string line, rusage *usage);     // in the session
+  int spawn_line(std::string line, bool own_group = false);
+  int spawn_line_io(const std::string &line, const int fds[3]);
+  int run_cmd(cmd *cmd_, bool tail = false);
+  int run_argv(std::vector<std::string> &argv);
+  int spawn_argv(std::vector<std::string> &argv);
+  // builtin stages, run in place of execvp
+  int run_builtin_stage(std::vector<std::string> &argv);
+  int builtin_cached(std::vector<std::string> &argv);
+  int builtin_watch(std::vector<std::string> &argv);
+  int builtin_timeout(std::vector<std::string> &argv);
+  int builtin_retry(std::vector<std::string> &argv);
+  int builtin_remote(std::vector<std::string> &argv);
+  // insert a throughput meter into every pipe, set by `time -m`
+  bool pipe_meter;
+  int pipe_index; // which pipe of the pipeline this process is on
+  bool stdin_given; // stdin of this process is a pipe or < of the line
+  // counters of each pipeline stage, set by `time -c`
+  stage_counts *stage_counters;
+  int run_counted_stage(cmd *stage);
+
+  // ==========================
+  // cpu placement
+  // ==========================
+  // cpus in the order pipeline stages are placed on them
+  std::vector<int> cpu_order;
+  unsigned *pin_turn; // next free place in cpu_order, shared with children
+  int pin_base;       // where the pipeline of this process starts in it
+  void init_cpu_order();
+  void reserve_cpus(pipe_cmd *pcmd);
+  void pin_stage(int stage);
+
+  // ==========================
+  // background jobs and make jobserver
+  // ==========================
+  // jobserver token pipe, as used by GNU make
+  // the shell itself holds the implicit token, so slots - 1 tokens are in it
+  int jobserver_fd[2];
+  int jobserver_try_fd; // non-blocking view of jobserver_fd[0]
+  // the implicit token is lent to a background job
+  bool implicit_token_lent;
+  // why jobs are held back, empty if they are not
+  std::string throttle_reason;
+  void init_jobserver(int slots);
+  void close_jobserver();
+  void inherit_jobserver();
+  bool acquire_token();
+  void release_token();
+  bool system_overloaded();
+  void schedule_jobs();
+  bool finish_job(int pid, int wait_status);
+  void reap_jobs();
+  void wait_beside_jobs(int pid);
+  void queue_job(std::string line);
+  void start_waiting_jobs();
+
+  // ==========================
+  // incremental mode
+  // ==========================
+  std::string incremental_db_path();
+  bool fingerprint_line(const std::string &line, unsigned long long &fingerprint,
+                        bool &up_to_date);
+  void record_fingerprint(const std::string &line,
+                          unsigned long long fingerprint);
+
+  // ==========================
+  // command hash
+  // ==========================
+  std::map<std::string, hashed_command> command_hash;
+  std::string hashed_path_env; // PATH the hash was made for
+  long hash_clock;
+  void hash_command(const std::string &name);
+  void hash_line(const std::string &line);
+  void forget_commands();
+  void exec_hashed(char **argv);
+
+  // ==========================
+  // warm start
+  // ==========================
+  bool loaded_state;
+  std::string state_path();
+  bool load_state(const std::string &path);
+  bool save_state(const std::string &path);
+
+  // ==========================
+  // line profile
+  // ==========================
+  std::map<std::string, line_profile> profile;
+  void profile_line(const std::string &line, double begin,
+                    const rusage &children_before, unsigned forks_before);
+  void report_profile();
+
+  // ==========================
+  // agent pool
+  // ==========================
+  unsigned *agent_turn; // round robin position, shared with children
+  int connect_agent();
+};
+
+// ==========================
+// server mode: one process hosting a session per client of a unix socket
+// ==========================
+int serve_sessions(const std::string &socket_path);
+// run the lines of stdin on a server, with our stdin, stdout and stderr
+int connect_session(const std::string &socket_path);
+
+// ==========================
+// string utilities, shared with the front end
+// ==========================
+std::vector<std::string> string_split(const std::string &s,
+                                      const std::string &delims);
+std::string string_split_last(const std::string &s, const std::string &delims);
+std::string string_split_first(const std::string &s,
+                               const std::string &delims);
+std::string trim(const std::string &s);
+
+#endif
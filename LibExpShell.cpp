@@ -0,0 +1,4595 @@
+// ==========================
+// LibExpShell.cpp
+// Parser and executor of ExpShell, see ExpShell.h.
+// by z0gSh1u @ 2020-09
+// ==========================
+
+#include "ExpShell.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <csignal>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fstream>
+#include <grp.h>
+#include <iostream>
+#include <linux/io_uring.h>
+#include <linux/perf_event.h>
+#include <map>
+#include <poll.h>
+#include <pwd.h>
+#include <sched.h>
+#include <set>
+#include <sstream>
+#include <string>
+#include <sys/inotify.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+// some constants
+const string WHITE_SPACE = " \t\r\n";
+const string SYMBOL = "|<>";
+
+#define MAX_ARGV_LEN 128
+#define SHOW_PANIC true
+#define SHOW_WAIT_PANIC false
+
+// OFLAG for file open
+#define REDIR_IN_OFLAG O_RDONLY
+#define REDIR_OUT_OFLAG (O_WRONLY | O_CREAT | O_TRUNC)
+#define TEE_APPEND_OFLAG (O_WRONLY | O_CREAT | O_APPEND)
+#define NEW_FILE_MODE 0644
+
+// size of buffers for C-style functions to get a string
+#define CHAR_BUF_SIZE 1024
+
+// panic
+void panic(string hint, bool exit_ = false, int exit_code = 0) {
+  if (SHOW_PANIC)
+    cerr << "[!ExpShell panic]: " << hint << endl;
+  if (exit_)
+    exit(exit_code);
+}
+
+// ==========================
+// string utilities
+// ==========================
+bool is_white_space(char ch) { return WHITE_SPACE.find(ch) != -1; }
+
+bool is_symbol(char ch) { return SYMBOL.find(ch) != -1; }
+
+vector<string> string_split(const string &s, const string &delims) {
+  vector<string> vec;
+  int p = 0, q;
+  while ((q = s.find_first_of(delims, p)) != string::npos) {
+    if (q > p)
+      vec.push_back(s.substr(p, q - p));
+    p = q + 1;
+  }
+  if (p < s.length())
+    vec.push_back(s.substr(p));
+  return vec;
+}
+
+// this split function will protect string inside quote
+vector<string> string_split_protect(const string &str, const string &delims) {
+  vector<string> vec;
+  string tmp = "";
+  for (int i = 0; i < str.length(); i++) {
+    if (is_white_space(str[i])) {
+      vec.push_back(tmp);
+      tmp = "";
+    } else if (str[i] == '\"') {
+      i++; // skip "
+      while (str[i] != '\"' && i < str.length()) {
+        tmp += str[i];
+        i++;
+      }
+      if (i == str.length())
+        panic("unclosed quote");
+    } else
+      tmp += str[i];
+  }
+  if (tmp.length() > 0)
+    vec.push_back(tmp);
+  return vec;
+}
+
+// the command line of argv[first...], the inverse of string_split_protect:
+// arguments with blanks are quoted back
+string argv_line(const vector<string> &argv, int first) {
+  string line;
+  for (int i = first; i < argv.size(); i++)
+    line += argv[i].find_first_of(WHITE_SPACE) == string::npos
+                ? argv[i] + " "
+                : "\"" + argv[i] + "\" ";
+  return line;
+}
+
+string string_split_last(const string &s, const string &delims) {
+  vector<string> split_res = string_split(s, delims);
+  return split_res.at(split_res.size() - 1);
+}
+
+string string_split_first(const string &s, const string &delims) {
+  vector<string> split_res = string_split(s, delims);
+  return split_res.at(0);
+}
+
+string trim(const string &s) {
+  if (s.length() == 0)
+    return string(s);
+  int p = 0, q = s.length() - 1;
+  while (is_white_space(s[p]))
+    p++;
+  while (is_white_space(s[q]))
+    q--;
+  return s.substr(p, q - p + 1);
+}
+
+// ==========================
+// process trace
+// set -o trace=FILE records when each process of the shell is spawned,
+// execs, is waited for and exits, then writes them as Chrome trace events
+// (for Perfetto or chrome://tracing) when the session ends or +o trace
+// events go to a buffer shared with all children, written to only at exit
+// ==========================
+#define TRACE_EVENTS 65536 // later events are dropped
+#define TRACE_NAME_LEN 80
+
+struct trace_event {
+  char kind;         // s spawn, e exec, w wait, x exit, m meter of time -m
+  int pid;           // the process the event happened in
+  int other;         // parent for s, process group for e, child for w and x,
+                     // input pipe fill % for m
+  int value;         // pipeline stage for e, exit code for x,
+                     // output pipe fill % for m
+  long long ts, dur; // us
+  long long bytes;   // moved through the pipe for m
+  char name[TRACE_NAME_LEN];
+};
+
+struct trace_buffer {
+  unsigned count;
+  long long start;
+  trace_event events[TRACE_EVENTS];
+};
+
+trace_buffer *trace = NULL;
+
+long long trace_clock() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+void trace_record(char kind, int pid, int other, int value, long long ts,
+                  long long dur = 0, const string &name = "",
+                  long long bytes = 0) {
+  if (trace == NULL)
+    return;
+  unsigned index = __sync_fetch_and_add(&trace->count, 1);
+  if (index >= TRACE_EVENTS)
+    return;
+  trace_event &event = trace->events[index];
+  event.kind = kind;
+  event.pid = pid;
+  event.other = other;
+  event.value = value;
+  event.ts = ts - trace->start;
+  event.dur = dur;
+  event.bytes = bytes;
+  strncpy(event.name, name.c_str(), TRACE_NAME_LEN - 1);
+  event.name[TRACE_NAME_LEN - 1] = 0;
+}
+
+bool start_trace() {
+  if (trace != NULL)
+    return true;
+  void *buffer = mmap(NULL, sizeof(trace_buffer), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (buffer == MAP_FAILED)
+    return false;
+  trace = (trace_buffer *)buffer;
+  trace->count = 0;
+  trace->start = trace_clock();
+  return true;
+}
+
+string json_string(const string &s) {
+  string quoted = "\"";
+  for (int i = 0; i < s.length(); i++) {
+    if (s[i] == '"' || s[i] == '\\')
+      quoted += '\\';
+    if ((unsigned char)s[i] < ' ')
+      quoted += ' ';
+    else
+      quoted += s[i];
+  }
+  return quoted + "\"";
+}
+
+// a process as the trace shows it, from spawn to exit
+struct traced_process {
+  long long start, end;
+  int ppid, pgid, stage, status;
+  string name;
+  traced_process()
+      : start(0), end(-1), ppid(0), pgid(0), stage(0), status(-1),
+        name("ExpShell") {}
+};
+
+// write the trace to path and stop tracing
+void finish_trace(const string &path) {
+  if (trace == NULL)
+    return;
+  unsigned count = min(trace->count, (unsigned)TRACE_EVENTS);
+  long long end = trace_clock() - trace->start;
+  ofstream out(path.c_str());
+  out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[" << endl;
+  map<int, traced_process> processes;
+  processes[getpid()].end = end; // the shell, there from the start
+  const char *sep = "";
+  for (unsigned i = 0; i < count; i++) {
+    trace_event &event = trace->events[i];
+    traced_process &process = processes[event.kind == 'x' || event.kind == 'w'
+                                            ? event.other
+                                            : event.pid];
+    char buf[CHAR_BUF_SIZE];
+    if (event.kind == 's') {
+      process.start = event.ts;
+      process.ppid = event.other;
+      // an arrow from the parent to the child
+      sprintf(buf,
+              "%s{\"ph\":\"s\",\"cat\":\"spawn\",\"name\":\"spawn\","
+              "\"id\":%d,\"pid\":%d,\"tid\":%d,\"ts\":%lld},\n"
+              "{\"ph\":\"f\",\"bp\":\"e\",\"cat\":\"spawn\",\"name\":"
+              "\"spawn\",\"id\":%d,\"pid\":%d,\"tid\":%d,\"ts\":%lld}",
+              sep, event.pid, event.other, event.other, event.ts, event.pid,
+              event.pid, event.pid, event.ts);
+      out << buf;
+    } else if (event.kind == 'e') {
+      process.name = event.name;
+      process.pgid = event.other;
+      process.stage = event.value;
+      sprintf(buf,
+              "%s{\"ph\":\"i\",\"s\":\"t\",\"cat\":\"exec\",\"name\":"
+              "\"exec\",\"pid\":%d,\"tid\":%d,\"ts\":%lld,\"args\":"
+              "{\"argv\":",
+              sep, event.pid, event.pid, event.ts);
+      out << buf << json_string(event.name) << "}}";
+    } else if (event.kind == 'w') {
+      sprintf(buf,
+              "%s{\"ph\":\"X\",\"cat\":\"wait\",\"name\":\"wait %d\","
+              "\"pid\":%d,\"tid\":%d,\"ts\":%lld,\"dur\":%lld}",
+              sep, event.other, event.pid, event.pid, event.ts, event.dur);
+      out << buf;
+    } else if (event.kind == 'm') {
+      sprintf(buf,
+              "%s{\"ph\":\"X\",\"cat\":\"meter\",\"name\":\"meter\","
+              "\"pid\":%d,\"tid\":%d,\"ts\":%lld,\"dur\":%lld,\"args\":"
+              "{\"bytes\":%lld,\"fill_in\":%d,\"fill_out\":%d,\"pipe\":",
+              sep, event.pid, event.pid, event.ts, event.dur, event.bytes,
+              event.other, event.value);
+      out << buf << json_string(event.name) << "}}";
+    } else { // exit, as seen by the parent reaping it
+      process.end = event.ts;
+      process.status = event.value;
+      continue;
+    }
+    sep = ",\n";
+  }
+  // each process is a track, with a slice from spawn to exit
+  for (map<int, traced_process>::iterator it = processes.begin();
+       it != processes.end(); it++) {
+    traced_process &process = it->second;
+    char buf[CHAR_BUF_SIZE];
+    sprintf(buf,
+            "%s{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,"
+            "\"args\":{\"name\":",
+            sep, it->first);
+    out << buf << json_string(process.name) << "}}";
+    sprintf(buf,
+            ",\n{\"ph\":\"X\",\"cat\":\"process\",\"pid\":%d,\"tid\":%d,"
+            "\"ts\":%lld,\"dur\":%lld,\"args\":{\"ppid\":%d,\"pgid\":%d,"
+            "\"stage\":%d,\"status\":%d},\"name\":",
+            it->first, it->first, process.start,
+            (process.end < 0 ? end : process.end) - process.start,
+            process.ppid, process.pgid, process.stage, process.status);
+    out << buf << json_string(process.name) << "}";
+    sep = ",\n";
+  }
+  out << endl << "]}" << endl;
+  if (trace->count > TRACE_EVENTS)
+    cerr << "trace: " << trace->count - TRACE_EVENTS << " events dropped"
+         << endl;
+  munmap(trace, sizeof(trace_buffer));
+  trace = NULL;
+}
+
+// ==========================
+// proxy functions
+// ==========================
+// processes forked by this shell and its children, see set -o profile
+unsigned *fork_count = NULL;
+
+// wrapped fork function that panics
+int fork_wrap() {
+  int pid = fork();
+  if (pid == -1)
+    panic("fork failed.", true, 1);
+  if (pid > 0 && fork_count != NULL)
+    __sync_fetch_and_add(fork_count, 1);
+  if (pid == 0 && trace != NULL)
+    trace_record('s', getpid(), getppid(), 0, trace_clock());
+  return pid;
+}
+
+// wrapped pipe function that panics
+int pipe_wrap(int pipe_fd[2]) {
+  int ret = pipe(pipe_fd);
+  if (ret == -1)
+    panic("pipe failed", true, 1);
+  return ret;
+}
+
+// wrapped dup2 function that panics
+int dup2_wrap(int fd1, int fd2) {
+  int dup2_ret = dup2(fd1, fd2);
+  if (dup2_ret < 0)
+    panic("dup2 failed.", true, 1);
+  return dup2_ret;
+}
+
+// wrapped open function that panics
+int open_wrap(const char *file, int oflag) {
+  int open_ret = open(file, oflag);
+  if (open_ret < 0)
+    panic("open failed.", true, 1);
+  return open_ret;
+}
+
+// exit code of a child like $? of sh, 128 + signal if it was killed
+int exit_code(int wait_status) {
+  if (WIFEXITED(wait_status))
+    return WEXITSTATUS(wait_status);
+  return WIFSIGNALED(wait_status) ? 128 + WTERMSIG(wait_status) : 1;
+}
+
+// waitpid that records the wait and the exit it sees, see set -o trace
+int wait_traced(int pid, int *wait_status, int options,
+                rusage *usage = NULL) {
+  long long begin = trace ? trace_clock() : 0;
+  int waited = wait4(pid, wait_status, options, usage);
+  if (trace == NULL || waited <= 0)
+    return waited;
+  long long end = trace_clock();
+  if (!(options & WNOHANG))
+    trace_record('w', getpid(), waited, 0, begin, end - begin);
+  trace_record('x', getpid(), waited, exit_code(*wait_status), end);
+  return waited;
+}
+
+// panic for wait status
+void check_wait_status(int &wait_status) {
+  if (WIFEXITED(wait_status) == 0) { // means abnormal exit
+    char buf[8];
+    sprintf(buf, "%d", WEXITSTATUS(wait_status));
+    if (SHOW_WAIT_PANIC)
+      panic("child exit with code " + string(buf));
+  }
+}
+
+// ==========================
+// cpu placement
+// ==========================
+// parse a cpu list like 0-3,8,10-11
+bool parse_cpu_list(const string &list, cpu_set_t *set) {
+  CPU_ZERO(set);
+  vector<string> ranges = string_split(list, ",");
+  if (ranges.empty())
+    return false;
+  for (int i = 0; i < ranges.size(); i++) {
+    char *end;
+    long lo = strtol(ranges[i].c_str(), &end, 10), hi = lo;
+    if (end == ranges[i].c_str())
+      return false;
+    if (*end == '-')
+      hi = strtol(end + 1, &end, 10);
+    if (*end != '\0' || lo < 0 || hi < lo || hi >= CPU_SETSIZE)
+      return false;
+    for (long cpu = lo; cpu <= hi; cpu++)
+      CPU_SET(cpu, set);
+  }
+  return true;
+}
+
+// first line of a (sysfs) file, or "" if missing
+string read_file_line(const string &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return "";
+  char buf[256];
+  ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0)
+    return "";
+  buf[n] = '\0';
+  return string_split_first(buf, "\n");
+}
+
+// where a cpu sits: socket, last level cache and physical core
+// each is identified by a number or its first cpu
+struct cpu_place {
+  int package, llc, core, cpu;
+};
+
+bool cpu_place_less(const cpu_place &a, const cpu_place &b) {
+  if (a.package != b.package)
+    return a.package < b.package;
+  if (a.llc != b.llc)
+    return a.llc < b.llc;
+  if (a.core != b.core)
+    return a.core < b.core;
+  return a.cpu < b.cpu;
+}
+
+// order the cpus we may run on so that neighbours share a cache:
+// grouped by socket and last level cache, one thread per physical core
+// first, hyperthread siblings only after every core is used
+void session::init_cpu_order() {
+  if (pin_turn == NULL) {
+    // shared, so that pipelines of jobs and dag workers take turns too
+    void *turn = mmap(NULL, sizeof(unsigned), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    pin_turn = turn == MAP_FAILED ? NULL : (unsigned *)turn;
+    if (pin_turn != NULL)
+      *pin_turn = 0;
+  }
+  if (!cpu_order.empty())
+    return;
+  cpu_set_t allowed;
+  sched_getaffinity(0, sizeof(allowed), &allowed);
+  vector<cpu_place> places;
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (!CPU_ISSET(cpu, &allowed))
+      continue;
+    char dir[64];
+    sprintf(dir, "/sys/devices/system/cpu/cpu%d/", cpu);
+    cpu_place place;
+    place.cpu = cpu;
+    place.package =
+        atoi(read_file_line(string(dir) + "topology/physical_package_id")
+                 .c_str());
+    place.core = atoi(
+        read_file_line(string(dir) + "topology/thread_siblings_list").c_str());
+    place.llc = place.package;
+    for (int index = 0;; index++) {
+      char cache[32];
+      sprintf(cache, "cache/index%d/", index);
+      string level = read_file_line(string(dir) + cache + "level");
+      if (level == "")
+        break;
+      if (atoi(level.c_str()) >= 2) // highest level wins
+        place.llc = atoi(
+            read_file_line(string(dir) + cache + "shared_cpu_list").c_str());
+    }
+    places.push_back(place);
+  }
+  sort(places.begin(), places.end(), cpu_place_less);
+  for (int i = 0; i < places.size(); i++)
+    if (places[i].core == places[i].cpu)
+      cpu_order.push_back(places[i].cpu);
+  for (int i = 0; i < places.size(); i++)
+    if (places[i].core != places[i].cpu)
+      cpu_order.push_back(places[i].cpu);
+}
+
+// pin this process to the cpu of the stage-th pipeline stage
+void session::pin_stage(int stage) {
+  if (cpu_order.empty())
+    return;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu_order[(pin_base + stage) % cpu_order.size()], &set);
+  sched_setaffinity(0, sizeof(set), &set);
+}
+
+// ==========================
+// builtin pipeline stages
+// these run inside the forked child in place of execvp
+// ==========================
+#define STAGE_CHUNK_SIZE 65536 // bytes moved per tee/splice round
+
+bool is_pipe_fd(int fd) {
+  struct stat st;
+  return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+// write all of buf to fd, returns false on error
+bool write_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    buf += n;
+    len -= n;
+  }
+  return true;
+}
+
+// move exactly len bytes from pipe in_fd to out_fd with splice
+// returns bytes moved, which is less than len only on error
+ssize_t splice_all(int in_fd, int out_fd, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = splice(in_fd, NULL, out_fd, NULL, len - done, SPLICE_F_MOVE);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    done += n;
+  }
+  return done;
+}
+
+// ==========================
+// io backend of builtin stages
+// set -o io=uring moves data with io_uring: reads go to a registered
+// buffer, and the writes of a chunk to all outputs are one submission
+// set -o io=rw (default), or no io_uring in the kernel, uses read/write
+// ==========================
+#define URING_ENTRIES 8 // operations in flight at once
+
+// whether the kernel has io_uring as stages need it, probed once
+// with a ring of one entry that is closed right away
+bool uring_available() {
+  static int available = -1;
+  if (available >= 0)
+    return available;
+  available = 0;
+#ifdef SYS_io_uring_setup
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int ring_fd = syscall(SYS_io_uring_setup, 1, &params);
+  if (ring_fd >= 0) {
+    // reads and writes at the current position of files need RW_CUR_POS
+    available = (params.features & IORING_FEAT_RW_CUR_POS) != 0;
+    close(ring_fd);
+  }
+#endif
+  return available;
+}
+
+class stage_io {
+public:
+  char *buffer; // of STAGE_CHUNK_SIZE, registered with io_uring
+  bool uring;   // false if read/write is used
+  stage_io(bool want_uring);
+  ~stage_io();
+  // read a chunk of fd into buffer, returns its length, 0 at EOF, -1 on error
+  ssize_t read_chunk(int fd);
+  // write all of data to each fd, returns false on error
+  bool write_all_to(const vector<int> &fds, const char *data, size_t len);
+
+private:
+  int ring_fd;
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_size, cq_ring_size;
+  unsigned *sq_tail, *sq_mask, *sq_array, *cq_head, *cq_tail, *cq_mask;
+  io_uring_sqe *sqes;
+  io_uring_cqe *cqes;
+  unsigned queued;
+  bool setup_uring();
+  void queue(int opcode, int fd, const char *data, size_t len);
+  bool submit(vector<int> &results);
+};
+
+stage_io::stage_io(bool want_uring) {
+  buffer = new char[STAGE_CHUNK_SIZE];
+  ring_fd = -1;
+  sq_ring = cq_ring = MAP_FAILED;
+  sqes = (io_uring_sqe *)MAP_FAILED;
+  queued = 0;
+  uring = want_uring && uring_available() && setup_uring();
+}
+
+stage_io::~stage_io() {
+  if (sqes != MAP_FAILED)
+    munmap(sqes, URING_ENTRIES * sizeof(io_uring_sqe));
+  if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+    munmap(cq_ring, cq_ring_size);
+  if (sq_ring != MAP_FAILED)
+    munmap(sq_ring, sq_ring_size);
+  if (ring_fd >= 0)
+    close(ring_fd);
+  delete[] buffer;
+}
+
+// map the rings and register buffer, false if io_uring is not usable:
+// too old, disabled by kernel.io_uring_disabled, or filtered by seccomp
+bool stage_io::setup_uring() {
+#ifdef SYS_io_uring_setup
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring_fd = syscall(SYS_io_uring_setup, URING_ENTRIES, &params);
+  // reads and writes at the current position of files need RW_CUR_POS
+  if (ring_fd < 0 || (params.features & IORING_FEAT_RW_CUR_POS) == 0)
+    return false;
+  sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single_mmap)
+    sq_ring_size = cq_ring_size = max(sq_ring_size, cq_ring_size);
+  sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  cq_ring = single_mmap ? sq_ring
+                        : mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_POPULATE, ring_fd,
+                               IORING_OFF_CQ_RING);
+  sqes = (io_uring_sqe *)mmap(NULL, params.sq_entries * sizeof(io_uring_sqe),
+                              PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                              ring_fd, IORING_OFF_SQES);
+  if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED)
+    return false;
+  char *sq = (char *)sq_ring, *cq = (char *)cq_ring;
+  sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  sq_array = (unsigned *)(sq + params.sq_off.array);
+  cq_head = (unsigned *)(cq + params.cq_off.head);
+  cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+  iovec iov;
+  iov.iov_base = buffer;
+  iov.iov_len = STAGE_CHUNK_SIZE;
+  return syscall(SYS_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, &iov,
+                 1) == 0;
+#else
+  return false;
+#endif
+}
+
+// queue an operation at the current position of fd, see submit
+void stage_io::queue(int opcode, int fd, const char *data, size_t len) {
+  unsigned tail = *sq_tail;
+  unsigned index = tail & *sq_mask;
+  io_uring_sqe *sqe = &sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->addr = (unsigned long)data;
+  sqe->len = len;
+  sqe->off = (__u64)-1;
+  sqe->buf_index = 0; // the registered buffer, for the fixed ones
+  sqe->user_data = queued++;
+  sq_array[index] = index;
+  __sync_synchronize(); // the kernel sees the entry before the new tail
+  *sq_tail = tail + 1;
+}
+
+// submit what is queued in one go and wait for all of it
+// results[i] is what operation i returned, -errno on error
+bool stage_io::submit(vector<int> &results) {
+  results.assign(queued, 0);
+  unsigned to_submit = queued, done = 0;
+  while (done < queued) {
+    int ret = syscall(SYS_io_uring_enter, ring_fd, to_submit, queued - done,
+                      IORING_ENTER_GETEVENTS, NULL, 0);
+    if (ret < 0 && errno != EINTR) {
+      queued = 0;
+      return false;
+    }
+    if (ret > 0)
+      to_submit -= ret;
+    unsigned head = *cq_head;
+    __sync_synchronize(); // read entries only after the tail they are under
+    for (; head != *cq_tail; head++, done++)
+      results[cqes[head & *cq_mask].user_data] = cqes[head & *cq_mask].res;
+    *cq_head = head;
+  }
+  queued = 0;
+  return true;
+}
+
+ssize_t stage_io::read_chunk(int fd) {
+  if (!uring) {
+    ssize_t n;
+    while ((n = read(fd, buffer, STAGE_CHUNK_SIZE)) < 0 && errno == EINTR)
+      ;
+    return n;
+  }
+  vector<int> results;
+  do {
+    queue(IORING_OP_READ_FIXED, fd, buffer, STAGE_CHUNK_SIZE);
+    if (!submit(results))
+      return -1;
+  } while (results[0] == -EINTR || results[0] == -EAGAIN);
+  if (results[0] < 0) {
+    errno = -results[0];
+    return -1;
+  }
+  return results[0];
+}
+
+bool stage_io::write_all_to(const vector<int> &fds, const char *data,
+                            size_t len) {
+  if (!uring) {
+    for (int i = 0; i < fds.size(); i++)
+      if (!write_all(fds[i], data, len))
+        return false;
+    return true;
+  }
+  bool fixed = data >= buffer && data + len <= buffer + STAGE_CHUNK_SIZE;
+  vector<size_t> written(fds.size(), 0);
+  while (true) {
+    vector<int> batch; // fds[batch[k]] is operation k
+    for (int i = 0; i < fds.size() && batch.size() < URING_ENTRIES; i++)
+      if (written[i] < len) {
+        queue(fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, fds[i],
+              data + written[i], len - written[i]);
+        batch.push_back(i);
+      }
+    if (batch.empty())
+      return true;
+    vector<int> results;
+    if (!submit(results))
+      return false;
+    for (int k = 0; k < batch.size(); k++) {
+      if (results[k] == -EINTR || results[k] == -EAGAIN)
+        continue;
+      if (results[k] <= 0) {
+        errno = -results[k];
+        return false;
+      }
+      written[batch[k]] += results[k]; // short writes are queued again
+    }
+  }
+}
+
+// plain read/write tee, used when stdin is not a pipe
+// or the outputs do not support splice
+int tee_copy(vector<int> &out_fds, bool uring) {
+  stage_io io(uring);
+  while (true) {
+    ssize_t n = io.read_chunk(fileno(stdin));
+    if (n < 0) {
+      panic("tee: read failed");
+      return 1;
+    }
+    if (n == 0)
+      return 0;
+    if (!io.write_all_to(out_fds, io.buffer, n)) {
+      panic("tee: write failed");
+      return 1;
+    }
+  }
+}
+
+// whether the builtin tee knows every option of argv,
+// for any other the external tee is run instead
+bool builtin_tee_args(const vector<string> &argv) {
+  for (int i = 1; i < argv.size(); i++)
+    if (argv[i][0] == '-' && argv[i] != "-a")
+      return false;
+  return true;
+}
+
+// open the files of tee [-a] file... and add them to fds
+// returns the flags they were opened with
+int open_tee_files(const vector<string> &argv, vector<int> &fds) {
+  int oflag = REDIR_OUT_OFLAG;
+  for (int i = 1; i < argv.size(); i++) {
+    if (argv[i] == "-a") {
+      oflag = TEE_APPEND_OFLAG;
+      continue;
+    }
+    int fd = open(argv[i].c_str(), oflag, NEW_FILE_MODE);
+    if (fd < 0)
+      panic("tee: cannot open " + argv[i]);
+    else
+      fds.push_back(fd);
+  }
+  return oflag;
+}
+
+// builtin tee: producer | tee [-a] file... | consumer
+// data never enters user space when stdin is a pipe:
+// tee(2) duplicates the pending bytes into a scratch pipe per extra output,
+// which is then spliced out, and the last output consumes stdin by splice(2)
+// returns -1 if the external tee has to run
+int builtin_tee(vector<string> &argv, bool uring) {
+  if (!builtin_tee_args(argv))
+    return -1;
+  vector<int> out_fds;
+  out_fds.push_back(fileno(stdout));
+  int oflag = open_tee_files(argv, out_fds);
+  // splice(2) refuses files opened with O_APPEND
+  if (!is_pipe_fd(fileno(stdin)) || oflag == TEE_APPEND_OFLAG)
+    return tee_copy(out_fds, uring);
+  // the last output consumes stdin, the others need a scratch pipe each
+  int consumer = out_fds.back();
+  vector<int> scratch; // scratch[2 * i] is read end, scratch[2 * i + 1] write
+  for (int i = 0; i + 1 < out_fds.size(); i++) {
+    int scratch_fd[2];
+    pipe_wrap(scratch_fd);
+    scratch.push_back(scratch_fd[0]);
+    scratch.push_back(scratch_fd[1]);
+  }
+  bool moved_any = false;
+  while (true) {
+    ssize_t n = -1;
+    for (int i = 0; i + 1 < out_fds.size(); i++) {
+      // duplicate pending bytes, the scratch pipe is empty so all of n fits
+      ssize_t m = tee(fileno(stdin), scratch[2 * i + 1],
+                      n < 0 ? STAGE_CHUNK_SIZE : n, 0);
+      if (m < 0 && errno == EINTR) {
+        i--;
+        continue;
+      }
+      if (m < 0 || (n >= 0 && m != n)) {
+        panic("tee: tee(2) failed");
+        return 1;
+      }
+      n = m;
+      if (n == 0)
+        return 0; // EOF
+      if (splice_all(scratch[2 * i], out_fds[i], n) != n) {
+        if (!moved_any && errno == EINVAL)
+          return tee_copy(out_fds, uring); // output does not support splice
+        panic("tee: splice failed");
+        return 1;
+      }
+      moved_any = true;
+    }
+    // consume what was duplicated, or whatever is pending if single output
+    ssize_t moved;
+    if (n < 0) {
+      moved = splice(fileno(stdin), NULL, consumer, NULL, STAGE_CHUNK_SIZE,
+                     SPLICE_F_MOVE);
+      if (moved < 0 && errno == EINTR)
+        continue;
+      if (moved == 0)
+        return 0; // EOF
+    } else
+      moved = splice_all(fileno(stdin), consumer, n);
+    if (moved < 0 || (n >= 0 && moved != n)) {
+      if (!moved_any && errno == EINVAL)
+        return tee_copy(out_fds, uring); // output does not support splice
+      panic("tee: splice failed");
+      return 1;
+    }
+    moved_any = true;
+  }
+}
+
+// seconds since some fixed point, for measuring durations
+double now_seconds() {
+  timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// forward in_fd to out_fd (both pipes) with splice and report throughput
+// before each splice the fill level of both pipes is sampled by FIONREAD:
+// a full downstream pipe means the consumer is slow,
+// an empty one means the producer is slow
+void meter_forward(int in_fd, int out_fd, string label) {
+  int capacity = fcntl(out_fd, F_GETPIPE_SZ);
+  if (capacity <= 0)
+    capacity = STAGE_CHUNK_SIZE;
+  double begin = now_seconds();
+  long long trace_begin = trace ? trace_clock() : 0;
+  long long bytes = 0, samples = 0;
+  double in_fill = 0, out_fill = 0, out_fill_max = 0;
+  while (true) {
+    int pending_in = 0, pending_out = 0;
+    ioctl(in_fd, FIONREAD, &pending_in);
+    ioctl(out_fd, FIONREAD, &pending_out);
+    double fill = (double)pending_out / capacity;
+    in_fill += (double)pending_in / capacity;
+    out_fill += fill;
+    if (fill > out_fill_max)
+      out_fill_max = fill;
+    samples++;
+    ssize_t n =
+        splice(in_fd, NULL, out_fd, NULL, STAGE_CHUNK_SIZE, SPLICE_F_MOVE);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      panic("meter: splice failed");
+    if (n <= 0)
+      break;
+    bytes += n;
+  }
+  double elapsed = now_seconds() - begin;
+  in_fill /= samples;
+  out_fill /= samples;
+  const char *verdict = "balanced";
+  if (out_fill > 0.75)
+    verdict = "consumer-bound";
+  else if (out_fill < 0.25)
+    verdict = "producer-bound";
+  char buf[256];
+  sprintf(buf,
+          ": %lld bytes in %.3fs (%.1f KB/s), fill in %.0f%% out %.0f%% "
+          "(max %.0f%%), ",
+          bytes, elapsed, elapsed > 0 ? bytes / elapsed / 1024 : 0.0,
+          in_fill * 100, out_fill * 100, out_fill_max * 100);
+  cerr << "meter\t" << label << buf << verdict << endl;
+  if (trace != NULL) // the same, as a slice of the meter process
+    trace_record('m', getpid(), (int)(in_fill * 100 + 0.5),
+                 (int)(out_fill * 100 + 0.5), trace_begin,
+                 trace_clock() - trace_begin, label + " " + verdict, bytes);
+}
+
+// ==========================
+// output cache
+// cached command... replays stdout, stderr and exit code of an earlier run
+// with the same argv, selected environment, input files and stdin
+// stdin counts only if the line gave it, by a pipe or <, otherwise the
+// command gets /dev/null, so the terminal or a script is not read
+// ==========================
+typedef unsigned long long hash_t;
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+hash_t hash_bytes(hash_t h, const char *buf, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char)buf[i];
+    h *= FNV_PRIME;
+  }
+  return h;
+}
+
+hash_t hash_string(hash_t h, const string &s) {
+  return hash_bytes(h, s.c_str(), s.length() + 1); // keep the \0 separator
+}
+
+// hash the rest of fd from its current offset
+hash_t hash_fd(hash_t h, int fd) {
+  char buf[STAGE_CHUNK_SIZE];
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0)
+    h = hash_bytes(h, buf, n);
+  return h;
+}
+
+string hash_hex(hash_t h) {
+  char buf[20];
+  sprintf(buf, "%016llx", h);
+  return buf;
+}
+
+// mkdir -p
+void make_dirs(const string &path) {
+  for (int p = 1; p <= path.length(); p++)
+    if (p == path.length() || path[p] == '/')
+      mkdir(path.substr(0, p).c_str(), 0755);
+}
+
+// copy a whole file to fd, returns false if it cannot be opened
+bool replay_file(const string &path, int out_fd) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  fstat(fd, &st);
+  off_t offset = 0;
+  while (offset < st.st_size)
+    if (sendfile(out_fd, fd, &offset, st.st_size - offset) <= 0)
+      break;
+  if (offset < st.st_size) { // out_fd does not take sendfile
+    char buf[STAGE_CHUNK_SIZE];
+    ssize_t n;
+    lseek(fd, offset, SEEK_SET);
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+      write_all(out_fd, buf, n);
+  }
+  close(fd);
+  return true;
+}
+
+// move a finished output file into the store under its content hash
+string store_object(const string &store, const string &tmp_path) {
+  int fd = open(tmp_path.c_str(), O_RDONLY);
+  string object = hash_hex(hash_fd(FNV_OFFSET, fd));
+  close(fd);
+  rename(tmp_path.c_str(), (store + "/objects/" + object).c_str());
+  return object;
+}
+
+int session::builtin_cached(vector<string> &argv) {
+  vector<string> command(argv.begin() + 1, argv.end());
+  if (command.empty()) {
+    panic("usage: cached command...");
+    return 2;
+  }
+  if (!stdin_given) {
+    int null_fd = open("/dev/null", O_RDONLY);
+    if (null_fd >= 0) {
+      dup2_wrap(null_fd, fileno(stdin));
+      close(null_fd);
+    }
+  }
+  string store = option_on("cache_dir") ? shell_options["cache_dir"]
+                                        : home() + "/.expshell/cache";
+  make_dirs(store + "/objects");
+  make_dirs(store + "/keys");
+  // key: argv, cwd, selected environment, input files, stdin
+  hash_t key = FNV_OFFSET;
+  for (int i = 0; i < command.size(); i++)
+    key = hash_string(key, command[i]);
+  char cwd[CHAR_BUF_SIZE];
+  getcwd(cwd, CHAR_BUF_SIZE);
+  key = hash_string(key, cwd);
+  vector<string> env_names = string_split(shell_options["cache_env"], ",");
+  for (int i = 0; i < env_names.size(); i++) {
+    const char *value = getenv(env_names[i].c_str());
+    key = hash_string(key, env_names[i] + "=" + (value ? value : ""));
+  }
+  for (int i = 1; i < command.size(); i++) {
+    struct stat st;
+    if (stat(command[i].c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+      continue;
+    int fd = open(command[i].c_str(), O_RDONLY);
+    if (fd >= 0) {
+      key = hash_fd(hash_string(key, command[i]), fd);
+      close(fd);
+    }
+  }
+  struct stat st;
+  fstat(fileno(stdin), &st);
+  if (!S_ISREG(st.st_mode)) {
+    // a pipe can only be read once, so keep a copy to feed the command
+    string tmp_path = store + "/objects/stdin.XXXXXX";
+    int fd = mkstemp(&tmp_path[0]);
+    if (fd < 0)
+      return run_argv(command);
+    unlink(tmp_path.c_str());
+    char buf[STAGE_CHUNK_SIZE];
+    ssize_t n;
+    while ((n = read(fileno(stdin), buf, sizeof(buf))) > 0)
+      write_all(fd, buf, n);
+    lseek(fd, 0, SEEK_SET);
+    dup2_wrap(fd, fileno(stdin));
+    close(fd);
+  }
+  off_t stdin_offset = lseek(fileno(stdin), 0, SEEK_CUR);
+  key = hash_fd(key, fileno(stdin));
+  lseek(fileno(stdin), stdin_offset, SEEK_SET);
+  // hit: keys/<key> holds `exit_code stdout_object stderr_object`
+  string key_path = store + "/keys/" + hash_hex(key);
+  ifstream entry(key_path.c_str());
+  int code;
+  string out_object, err_object;
+  if (entry >> code >> out_object >> err_object &&
+      replay_file(store + "/objects/" + out_object, fileno(stdout)) &&
+      replay_file(store + "/objects/" + err_object, fileno(stderr)))
+    return code;
+  // miss: run it with output captured, then store and replay
+  string out_path = store + "/objects/out.XXXXXX";
+  string err_path = store + "/objects/err.XXXXXX";
+  int out_fd = mkstemp(&out_path[0]);
+  int err_fd = mkstemp(&err_path[0]);
+  if (out_fd < 0 || err_fd < 0)
+    return run_argv(command);
+  int pid = fork_wrap();
+  if (pid == 0) {
+    dup2_wrap(out_fd, fileno(stdout));
+    dup2_wrap(err_fd, fileno(stderr));
+    exit(run_argv(command));
+  }
+  close(out_fd);
+  close(err_fd);
+  int wait_status;
+  wait_traced(pid, &wait_status, 0);
+  code = exit_code(wait_status);
+  replay_file(out_path, fileno(stdout));
+  replay_file(err_path, fileno(stderr));
+  if (!WIFEXITED(wait_status)) { // killed, the output is not complete
+    unlink(out_path.c_str());
+    unlink(err_path.c_str());
+    return code;
+  }
+  out_object = store_object(store, out_path);
+  err_object = store_object(store, err_path);
+  string tmp_key_path = key_path + ".tmp";
+  ofstream(tmp_key_path.c_str())
+      << code << " " << out_object << " " << err_object << endl;
+  rename(tmp_key_path.c_str(), key_path.c_str());
+  return code;
+}
+
+// ==========================
+// watch [-d ms] -p path... -- command
+// reruns command whenever something below the paths changes
+// ==========================
+#define WATCH_EVENTS                                                           \
+  (IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE |          \
+   IN_MOVED_FROM | IN_MOVED_TO)
+#define WATCH_DEBOUNCE_MS 200  // quiet time before a burst counts as done
+#define WATCH_POLL_MS 100      // how often a running command is checked
+#define WATCH_EVENT_BUF 4096
+
+// a builtin stage that runs a command keeps it in its own process group,
+// so the whole pipeline of it can be stopped
+int stage_child = 0;
+
+void cancel_stage_child() {
+  if (stage_child <= 0)
+    return;
+  kill(-stage_child, SIGTERM);
+  int wait_status;
+  wait_traced(stage_child, &wait_status, 0);
+  stage_child = 0;
+}
+
+// the stage itself is interrupted, do not leave the command behind
+void stage_on_signal(int sig) {
+  cancel_stage_child();
+  _exit(128 + sig);
+}
+
+void cancel_stage_child_on_signal() {
+  signal(SIGINT, stage_on_signal);
+  signal(SIGTERM, stage_on_signal);
+  signal(SIGHUP, stage_on_signal);
+}
+
+// inotify is not recursive, so every directory below path is watched
+void watch_tree(int inotify_fd, const string &path, map<int, string> &dirs) {
+  int wd = inotify_add_watch(inotify_fd, path.c_str(), WATCH_EVENTS);
+  if (wd < 0) {
+    panic("watch: cannot watch " + path);
+    return;
+  }
+  dirs[wd] = path;
+  DIR *dir = opendir(path.c_str());
+  if (dir == NULL)
+    return; // a plain file
+  dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    string name = entry->d_name;
+    struct stat st;
+    if (name == "." || name == ".." ||
+        lstat((path + "/" + name).c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+      continue;
+    watch_tree(inotify_fd, path + "/" + name, dirs);
+  }
+  closedir(dir);
+}
+
+int session::builtin_watch(vector<string> &argv) {
+  int debounce_ms = WATCH_DEBOUNCE_MS;
+  vector<string> paths;
+  string command;
+  for (int i = 1; i < argv.size(); i++) {
+    if (argv[i] == "--") {
+      command = argv_line(argv, i + 1);
+      break;
+    } else if (argv[i] == "-p" && i + 1 < argv.size())
+      paths.push_back(argv[++i]);
+    else if (argv[i] == "-d" && i + 1 < argv.size())
+      debounce_ms = atoi(argv[++i].c_str());
+    else
+      paths.push_back(argv[i]);
+  }
+  if (paths.empty() || trim(command).empty()) {
+    panic("usage: watch [-d ms] -p path... -- command");
+    return 2;
+  }
+  int inotify_fd = inotify_init();
+  if (inotify_fd < 0) {
+    panic("watch: inotify_init failed");
+    return 1;
+  }
+  map<int, string> dirs; // watch descriptor -> directory
+  for (int i = 0; i < paths.size(); i++)
+    watch_tree(inotify_fd, paths[i], dirs);
+  cancel_stage_child_on_signal();
+  bool changed = true; // the first run
+  double last_event = 0;
+  while (true) {
+    // a burst of events is over, cancel the in-flight run and restart
+    if (changed && (now_seconds() - last_event) * 1000 >= debounce_ms) {
+      changed = false;
+      if (stage_child > 0)
+        cerr << "[watch] change detected, restarting" << endl;
+      cancel_stage_child();
+      stage_child = spawn_line(command, true);
+    }
+    int timeout = -1;
+    if (changed)
+      timeout = max(1, (int)(debounce_ms - (now_seconds() - last_event) * 1000));
+    else if (stage_child > 0)
+      timeout = WATCH_POLL_MS;
+    pollfd pfd;
+    pfd.fd = inotify_fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, timeout) > 0) {
+      char buf[WATCH_EVENT_BUF];
+      ssize_t n = read(inotify_fd, buf, sizeof(buf));
+      for (ssize_t p = 0; p < n;) {
+        inotify_event *event = (inotify_event *)(buf + p);
+        if (event->mask & IN_IGNORED) // removed, or its directory is gone
+          dirs.erase(event->wd);
+        else if ((event->mask & IN_ISDIR) &&
+            (event->mask & (IN_CREATE | IN_MOVED_TO)) &&
+            dirs.count(event->wd) != 0)
+          watch_tree(inotify_fd, dirs[event->wd] + "/" + event->name, dirs);
+        p += sizeof(inotify_event) + event->len;
+      }
+      changed = true;
+      last_event = now_seconds();
+    }
+    int wait_status;
+    if (stage_child > 0 &&
+        wait_traced(stage_child, &wait_status, WNOHANG) == stage_child) {
+      stage_child = 0;
+      char buf[64];
+      sprintf(buf, "[watch] exit %d, waiting for changes",
+              exit_code(wait_status));
+      cerr << buf << endl;
+    }
+  }
+}
+
+// ==========================
+// timeout and retry
+// the command is waited for through its pidfd, together with a timerfd
+// ==========================
+#define TIMEOUT_EXIT_CODE 124   // like coreutils timeout
+#define TIMEOUT_KILL_AFTER 5.0  // seconds between TERM and KILL
+#define RETRY_DELAY 1.0         // seconds before the first retry
+#define PIDLESS_POLL_MS 10      // wait granularity without pidfd
+
+// 10, 1.5, 500ms, 2s, 1m, 1h, returns a negative number if malformed
+double parse_duration(const string &s) {
+  char *end;
+  double value = strtod(s.c_str(), &end);
+  string unit(end);
+  if (end == s.c_str() || value < 0)
+    return -1;
+  if (unit == "" || unit == "s")
+    return value;
+  if (unit == "ms")
+    return value / 1000;
+  if (unit == "m")
+    return value * 60;
+  if (unit == "h")
+    return value * 3600;
+  return -1;
+}
+
+// run argv in a new process group as the stage child
+int session::spawn_argv(vector<string> &argv) {
+  int pid = fork_wrap();
+  if (pid == 0) {
+    setpgid(0, 0);
+    exit(run_argv(argv));
+  }
+  setpgid(pid, pid);
+  stage_child = pid;
+  return pid;
+}
+
+// a one-shot timerfd firing after seconds
+int timer_after(double seconds) {
+  int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  if (timer_fd < 0)
+    panic("timerfd_create failed", true, 1);
+  itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  spec.it_value.tv_sec = (time_t)seconds;
+  spec.it_value.tv_nsec = (long)((seconds - (time_t)seconds) * 1e9);
+  if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0)
+    spec.it_value.tv_nsec = 1; // zero would disarm it
+  timerfd_settime(timer_fd, 0, &spec, NULL);
+  return timer_fd;
+}
+
+// wait until pid exits or timer_fd fires, pid may be 0 to only wait the timer
+// returns true if pid exited, with its wait status stored
+bool wait_pid_or_timer(int pid, int timer_fd, int &wait_status) {
+  int pid_fd = -1;
+#ifdef SYS_pidfd_open
+  if (pid > 0)
+    pid_fd = syscall(SYS_pidfd_open, pid, 0);
+#endif
+  pollfd pfds[2];
+  pfds[0].fd = timer_fd;
+  pfds[0].events = POLLIN;
+  pfds[1].fd = pid_fd;
+  pfds[1].events = POLLIN;
+  bool exited = false;
+  while (true) {
+    // without pidfd (kernel < 5.3) fall back to checking now and then
+    int timeout = pid > 0 && pid_fd < 0 ? PIDLESS_POLL_MS : -1;
+    int ready = poll(pfds, pid_fd < 0 ? 1 : 2, timeout);
+    if (ready < 0 && errno != EINTR)
+      break;
+    if (pid > 0 && (pid_fd < 0 || pfds[1].revents) &&
+        wait_traced(pid, &wait_status, WNOHANG) == pid) {
+      exited = true;
+      break;
+    }
+    if (ready > 0 && pfds[0].revents)
+      break;
+  }
+  if (pid_fd >= 0)
+    close(pid_fd);
+  return exited;
+}
+
+// timeout [-k kill_after] duration command...
+// sends TERM to the command when it runs too long, KILL if it still runs
+int session::builtin_timeout(vector<string> &argv) {
+  double kill_after = TIMEOUT_KILL_AFTER;
+  int i = 1;
+  if (argv.size() > 2 && argv[1] == "-k") {
+    kill_after = parse_duration(argv[2]);
+    i = 3;
+  }
+  double duration = i < argv.size() ? parse_duration(argv[i]) : -1;
+  if (duration < 0 || kill_after < 0 || i + 1 >= argv.size()) {
+    panic("usage: timeout [-k kill_after] duration command...");
+    return 2;
+  }
+  vector<string> command(argv.begin() + i + 1, argv.end());
+  cancel_stage_child_on_signal();
+  int pid = spawn_argv(command);
+  int wait_status;
+  int timer_fd = timer_after(duration);
+  bool exited = wait_pid_or_timer(pid, timer_fd, wait_status);
+  close(timer_fd);
+  if (exited)
+    return exit_code(wait_status);
+  kill(-pid, SIGTERM);
+  timer_fd = timer_after(kill_after);
+  exited = wait_pid_or_timer(pid, timer_fd, wait_status);
+  close(timer_fd);
+  if (!exited) {
+    kill(-pid, SIGKILL);
+    wait_traced(pid, &wait_status, 0);
+    return 128 + SIGKILL;
+  }
+  return TIMEOUT_EXIT_CODE;
+}
+
+// retry n [--backoff] [-d delay] command...
+// reruns a failing command up to n times in total,
+// with --backoff the delay doubles after each failure
+int session::builtin_retry(vector<string> &argv) {
+  int attempts = argv.size() > 1 ? atoi(argv[1].c_str()) : 0;
+  double delay = RETRY_DELAY;
+  bool backoff = false;
+  int i = 2;
+  for (; i < argv.size(); i++) {
+    if (argv[i] == "--backoff")
+      backoff = true;
+    else if (argv[i] == "-d" && i + 1 < argv.size())
+      delay = parse_duration(argv[++i]);
+    else
+      break;
+  }
+  if (attempts < 1 || delay < 0 || i >= argv.size()) {
+    panic("usage: retry n [--backoff] [-d delay] command...");
+    return 2;
+  }
+  vector<string> command(argv.begin() + i, argv.end());
+  cancel_stage_child_on_signal();
+  int code = 0;
+  for (int attempt = 1; attempt <= attempts; attempt++) {
+    int pid = spawn_argv(command);
+    int wait_status;
+    wait_traced(pid, &wait_status, 0);
+    stage_child = 0;
+    code = exit_code(wait_status);
+    if (code == 0 || attempt == attempts)
+      break;
+    char buf[96];
+    sprintf(buf, "[retry] attempt %d/%d exit %d, again in %.2fs", attempt,
+            attempts, code, delay);
+    cerr << buf << endl;
+    int timer_fd = timer_after(delay);
+    wait_pid_or_timer(0, timer_fd, wait_status);
+    close(timer_fd);
+    if (backoff)
+      delay *= 2;
+  }
+  return code;
+}
+
+// run argv as a builtin stage if it is one
+// returns the exit code, or -1 if argv is not a builtin stage
+bool is_builtin_stage(const string &name) {
+  const char *stages[] = {"tee", "cached", "watch", "timeout", "retry",
+                          "remote"};
+  for (int i = 0; i < sizeof(stages) / sizeof(stages[0]); i++)
+    if (name == stages[i])
+      return true;
+  return false;
+}
+
+int session::run_builtin_stage(vector<string> &argv) {
+  if (argv[0] == "tee")
+    return builtin_tee(argv, uring_io());
+  if (argv[0] == "cached")
+    return builtin_cached(argv);
+  if (argv[0] == "watch")
+    return builtin_watch(argv);
+  if (argv[0] == "timeout")
+    return builtin_timeout(argv);
+  if (argv[0] == "retry")
+    return builtin_retry(argv);
+  if (argv[0] == "remote")
+    return builtin_remote(argv);
+  return -1;
+}
+
+// ==========================
+// command line parsing
+// ==========================
+#define CMD_TYPE_NULL 0      // initial value
+#define CMD_TYPE_EXEC 1      // common exec command
+#define CMD_TYPE_PIPE 2      // pipe command
+#define CMD_TYPE_REDIR_IN 4  // redirect using <
+#define CMD_TYPE_REDIR_OUT 8 // redirect using >
+#define CMD_TYPE_GROUP 16    // ( list ) or { list; }
+#define CMD_TYPE_FUSED 32    // builtin filter stages run in one process
+
+// base class for any cmd
+class cmd {
+public:
+  int type;
+  cmd() { this->type = CMD_TYPE_NULL; }
+};
+
+// most common type of cmd
+// argv[0] ...argv[1~n]
+class exec_cmd : public cmd {
+public:
+  vector<string> argv;
+  exec_cmd(vector<string> &argv) {
+    this->type = CMD_TYPE_EXEC;
+    this->argv = vector<string>(argv);
+  }
+};
+
+// pipe cmd
+// left | right
+class pipe_cmd : public cmd {
+public:
+  cmd *left;
+  cmd *right;
+  pipe_cmd() { this->type = CMD_TYPE_PIPE; }
+  pipe_cmd(cmd *left, cmd *right) {
+    this->type = CMD_TYPE_PIPE;
+    this->left = left;
+    this->right = right;
+  }
+};
+
+// redirect cmd
+// ls > a.txt; some_program < b.txt
+class redirect_cmd : public cmd {
+public:
+  cmd *cmd_;
+  string file;
+  int fd;
+  redirect_cmd() {}
+  redirect_cmd(int type, cmd *cmd_, string file, int fd) {
+    this->type = type;
+    this->cmd_ = cmd_;
+    this->file = file;
+    this->fd = fd;
+  }
+};
+
+// ( list ) runs in a subshell, { list; } in the shell itself
+class group_cmd : public cmd {
+public:
+  string body; // the list inside
+  bool subshell;
+  group_cmd(string body, bool subshell) {
+    this->type = CMD_TYPE_GROUP;
+    this->body = body;
+    this->subshell = subshell;
+  }
+};
+
+// index of the ) or } closing the group opened at line[open], -1 if none
+int group_end(const string &line, int open) {
+  int depth = 0;
+  bool quoted = false;
+  for (int i = open; i < line.length(); i++) {
+    if (line[i] == '\"')
+      quoted = !quoted;
+    else if (quoted)
+      continue;
+    else if (line[i] == '(' || line[i] == '{')
+      depth++;
+    else if ((line[i] == ')' || line[i] == '}') && --depth == 0)
+      return i;
+  }
+  return -1;
+}
+
+// whether line[i] opens a group: ( anywhere a command starts, or {
+// followed by a blank, so that arguments like {} stay as they are
+bool opens_group(const string &line, int i) {
+  return line[i] == '(' ||
+         (line[i] == '{' && i + 1 < line.length() && is_white_space(line[i + 1]));
+}
+
+// whether the line is a single group, whose list is stored to body
+bool is_group(const string &line, string &body, bool &subshell) {
+  if (line.empty() || !opens_group(line, 0) ||
+      group_end(line, 0) != line.length() - 1)
+    return false;
+  body = trim(line.substr(1, line.length() - 2));
+  subshell = line[0] == '(';
+  return true;
+}
+
+// parse seg as is exec_cmd
+cmd *parse_exec_cmd(string seg) {
+  seg = trim(seg);
+  vector<string> argv = string_split_protect(seg, WHITE_SPACE);
+  return new exec_cmd(argv);
+}
+
+// split a list of commands, like a && b || c ; d
+// the operators between the commands are stored to ops
+vector<string> split_list(const string &line, vector<string> &ops) {
+  vector<string> commands;
+  int start = 0;
+  int depth = 0; // of groups, whose lists are split when they run
+  bool quoted = false;
+  for (int i = 0; i < line.length(); i++) {
+    if (line[i] == '\\') { // escaped, like \; of find -exec
+      i++;
+      continue;
+    }
+    if (line[i] == '\"')
+      quoted = !quoted;
+    if (!quoted && (line[i] == '(' || line[i] == '{'))
+      depth++;
+    if (!quoted && (line[i] == ')' || line[i] == '}'))
+      depth--;
+    if (quoted || depth > 0)
+      continue;
+    string op = line.substr(i, 2);
+    if (op != "&&" && op != "||")
+      op = line.substr(i, 1);
+    if (op != "&&" && op != "||" && op != ";")
+      continue;
+    commands.push_back(trim(line.substr(start, i - start)));
+    ops.push_back(op);
+    i += op.length() - 1;
+    start = i + 1;
+  }
+  commands.push_back(trim(line.substr(start)));
+  if (commands.back().empty() && ops.size() > 0 && ops.back() == ";") {
+    commands.pop_back(); // a trailing ; ends the list
+    ops.pop_back();
+  }
+  return commands;
+}
+
+// whether the command after op runs, given the exit code before it
+bool list_continues(const string &op, int status) {
+  return op == ";" || (op == "&&" && status == 0) || (op == "||" && status != 0);
+}
+
+// divide-and-conquer
+// **test cases:**
+// ls -a < a.txt | grep linux > b.txt
+// some_bin "hello world" > b.txt > c.txt
+cmd *parse(string line) {
+  line = trim(line);
+  string cur_read = "";
+  cmd no_cmd; // until a command is read
+  cmd *cur_cmd = &no_cmd;
+  int i = 0;
+  while (i < line.length()) {
+    int end;
+    if (cur_cmd->type == CMD_TYPE_NULL && trim(cur_read).empty() &&
+        opens_group(line, i) && (end = group_end(line, i)) > 0) {
+      // ( list ) or { list; }, may be redirected or piped like a command
+      cur_cmd = new group_cmd(trim(line.substr(i + 1, end - i - 1)),
+                              line[i] == '(');
+      cur_read = "";
+      i = end + 1;
+    } else if (line[i] == '<' || line[i] == '>') {
+      // [lhs] < (or >) [rhs], lhs may already be redirected: a < b > c
+      cmd *lhs =
+          cur_cmd->type == CMD_TYPE_NULL ? parse_exec_cmd(cur_read) : cur_cmd;
+      int j = i + 1;
+      while (j < line.length() && !is_symbol(line[j]))
+        j++;
+      string file = trim(line.substr(i + 1, j - i - 1));
+      cur_cmd = new redirect_cmd(line[i] == '<' ? CMD_TYPE_REDIR_IN
+                                                : CMD_TYPE_REDIR_OUT,
+                                 lhs, file, -1); // fd wait for filling
+      i = j;
+    } else if (line[i] == '|') {
+      cmd *rhs = parse(line.substr(i + 1)); // recursive
+      if (cur_cmd->type == CMD_TYPE_NULL)
+        cur_cmd = parse_exec_cmd(cur_read);
+      cur_cmd = new pipe_cmd(cur_cmd, rhs);
+      return cur_cmd;
+    } else
+      cur_read += line[i++];
+  }
+  if (cur_cmd->type == CMD_TYPE_NULL)
+    return parse_exec_cmd(cur_read);
+  else
+    return cur_cmd;
+}
+
+// delete a tree made by parse, for trees the session itself keeps no longer
+// than a line; children exit with theirs
+void free_cmd(cmd *cmd_) {
+  if (cmd_->type == CMD_TYPE_EXEC)
+    delete static_cast<exec_cmd *>(cmd_);
+  else if (cmd_->type == CMD_TYPE_PIPE) {
+    pipe_cmd *pcmd = static_cast<pipe_cmd *>(cmd_);
+    free_cmd(pcmd->left);
+    free_cmd(pcmd->right);
+    delete pcmd;
+  } else if (cmd_->type & (CMD_TYPE_REDIR_IN | CMD_TYPE_REDIR_OUT)) {
+    redirect_cmd *rcmd = static_cast<redirect_cmd *>(cmd_);
+    free_cmd(rcmd->cmd_);
+    delete rcmd;
+  } else if (cmd_->type == CMD_TYPE_GROUP)
+    delete static_cast<group_cmd *>(cmd_);
+  else
+    delete cmd_;
+}
+
+// ==========================
+// fused builtin stages
+// consecutive builtin filter stages of a pipeline run in one process,
+// as step functions handing buffers to each other in turn, so only the
+// ends of the run are pipes: a | tee x | tee y | b is three processes
+// ==========================
+// a builtin filter stage, resumed with each chunk of its input
+class filter_stage {
+public:
+  stage_io *io; // of the fused run, for stages writing to files
+  virtual ~filter_stage() {}
+  // take the chunk at data and leave there what the stage passes on,
+  // the chunk itself or a buffer of the stage, so nothing is copied between
+  // returns false if the stage failed
+  virtual bool step(const char *&data, size_t &len) = 0;
+};
+
+// tee [-a] file... - pass input on, with a copy to each file
+class tee_stage : public filter_stage {
+public:
+  vector<int> fds;
+  tee_stage(vector<string> &argv) { open_tee_files(argv, fds); }
+  ~tee_stage() {
+    for (int i = 0; i < fds.size(); i++)
+      close(fds[i]);
+  }
+  bool step(const char *&data, size_t &len) {
+    return io->write_all_to(fds, data, len); // and passes the chunk as is
+  }
+};
+
+// the stage for argv, NULL if it is not a builtin filter
+filter_stage *make_filter_stage(vector<string> &argv) {
+  if (argv[0] == "tee")
+    return new tee_stage(argv);
+  return NULL;
+}
+
+// argv without the blanks left by parsing
+vector<string> stage_args(exec_cmd *ecmd) {
+  vector<string> args;
+  for (int i = 0; i < ecmd->argv.size(); i++) {
+    string arg_trim = trim(ecmd->argv[i]);
+    if (arg_trim.length() > 0)
+      args.push_back(arg_trim);
+  }
+  return args;
+}
+
+bool is_filter_cmd(cmd *cmd_) {
+  if (cmd_->type != CMD_TYPE_EXEC)
+    return false;
+  vector<string> args = stage_args(static_cast<exec_cmd *>(cmd_));
+  // tee with options of its own is left to the external tee
+  return !args.empty() && args[0] == "tee" && builtin_tee_args(args);
+}
+
+class fused_cmd : public cmd {
+public:
+  vector<exec_cmd *> stages;
+  fused_cmd() { this->type = CMD_TYPE_FUSED; }
+};
+
+// turn a | b | rest, with a and b builtin filters, into fused(a, b) | rest
+// rest is NULL if the whole pipeline was fused
+void fuse_filter_stages(pipe_cmd *pcmd) {
+  if (!is_filter_cmd(pcmd->left))
+    return;
+  fused_cmd *fused = new fused_cmd();
+  fused->stages.push_back(static_cast<exec_cmd *>(pcmd->left));
+  cmd *rest = pcmd->right;
+  while (rest != NULL) {
+    if (rest->type == CMD_TYPE_PIPE &&
+        is_filter_cmd(static_cast<pipe_cmd *>(rest)->left)) {
+      pipe_cmd *next = static_cast<pipe_cmd *>(rest);
+      fused->stages.push_back(static_cast<exec_cmd *>(next->left));
+      rest = next->right;
+    } else if (is_filter_cmd(rest)) {
+      fused->stages.push_back(static_cast<exec_cmd *>(rest));
+      rest = NULL;
+    } else
+      break;
+  }
+  if (fused->stages.size() < 2) {
+    delete fused;
+    return;
+  }
+  pcmd->left = fused;
+  pcmd->right = rest;
+}
+
+// run fused stages from stdin to stdout, returns the exit code
+int run_fused_stages(fused_cmd *fcmd, bool uring) {
+  stage_io io(uring);
+  vector<filter_stage *> stages;
+  for (int i = 0; i < fcmd->stages.size(); i++) {
+    vector<string> args = stage_args(fcmd->stages[i]);
+    stages.push_back(make_filter_stage(args));
+    stages.back()->io = &io;
+  }
+  vector<int> out_fds(1, fileno(stdout));
+  bool ok = true;
+  while (ok) {
+    ssize_t n = io.read_chunk(fileno(stdin));
+    if (n < 0)
+      panic("tee: read failed");
+    if (n <= 0) {
+      ok = n == 0;
+      break;
+    }
+    // each stage in turn takes the chunk the one before left
+    const char *data = io.buffer;
+    size_t len = n;
+    for (int i = 0; ok && i < stages.size(); i++)
+      ok = stages[i]->step(data, len);
+    ok = ok && io.write_all_to(out_fds, data, len);
+  }
+  for (int i = 0; i < stages.size(); i++)
+    delete stages[i];
+  return ok ? 0 : 1;
+}
+
+// ==========================
+// performance counters, for time -c
+// counters are opened with inherit on the process to count, so the
+// children it forks afterwards, and what they exec, are counted too
+// the hardware ones are missing on VMs without a PMU, and all of them
+// if perf_event_paranoid forbids, they are reported as not supported
+// ==========================
+#define PERF_COUNTERS 6
+#define STAGE_SLOTS 16 // pipeline stages counted apart, the rest share one
+
+struct perf_counter_kind {
+  unsigned type;
+  unsigned long long config;
+  const char *name;
+};
+
+const perf_counter_kind perf_kinds[PERF_COUNTERS] = {
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, "task-clock"},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, "context-switches"},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, "page-faults"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "cache-misses"}};
+
+// counts of a pipeline stage, in memory shared with the stage processes
+struct stage_counts {
+  bool used;
+  char name[64];
+  long long values[PERF_COUNTERS];
+};
+
+// open the counters on this process, -1 for those not supported
+void open_perf_counters(int fds[PERF_COUNTERS]) {
+  for (int i = 0; i < PERF_COUNTERS; i++) {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = perf_kinds[i].type;
+    attr.config = perf_kinds[i].config;
+    attr.inherit = 1;
+    attr.read_format =
+        PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fds[i] < 0 && errno == EACCES) { // may count user space only
+      attr.exclude_kernel = attr.exclude_hv = 1;
+      fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    if (fds[i] >= 0)
+      fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+  }
+}
+
+// read and close the counters, -1 for those not supported
+// a counter that shared the PMU with others is scaled to the whole run
+void read_perf_counters(int fds[PERF_COUNTERS],
+                        long long values[PERF_COUNTERS]) {
+  for (int i = 0; i < PERF_COUNTERS; i++) {
+    unsigned long long data[3]; // value, time enabled, time running
+    values[i] = -1;
+    if (fds[i] < 0)
+      continue;
+    if (read(fds[i], data, sizeof(data)) == sizeof(data) && data[2] > 0)
+      values[i] = data[2] < data[1]
+                      ? (long long)((double)data[0] * data[1] / data[2])
+                      : data[0];
+    close(fds[i]);
+  }
+}
+
+void print_perf_counters(const long long values[PERF_COUNTERS],
+                         const char *indent) {
+  char buf[128];
+  for (int i = 0; i < PERF_COUNTERS; i++) {
+    if (values[i] < 0)
+      sprintf(buf, "%s%16s  %s", indent, "<not supported>", perf_kinds[i].name);
+    else if (i == 0) // in ns
+      sprintf(buf, "%s%13.3f ms  %s", indent, values[i] / 1e6,
+              perf_kinds[i].name);
+    else
+      sprintf(buf, "%s%16lld  %s", indent, values[i], perf_kinds[i].name);
+    cerr << buf << endl;
+  }
+}
+
+// what a pipeline stage runs, to label its counts
+string stage_name(cmd *cmd_) {
+  string name;
+  if (cmd_->type == CMD_TYPE_EXEC) {
+    vector<string> args = stage_args(static_cast<exec_cmd *>(cmd_));
+    for (int i = 0; i < args.size(); i++)
+      name += (i ? " " : "") + args[i];
+  } else if (cmd_->type == CMD_TYPE_FUSED) {
+    fused_cmd *fcmd = static_cast<fused_cmd *>(cmd_);
+    for (int i = 0; i < fcmd->stages.size(); i++)
+      name += (i ? " | " : "") + stage_name(fcmd->stages[i]);
+  } else if (cmd_->type == CMD_TYPE_REDIR_IN ||
+             cmd_->type == CMD_TYPE_REDIR_OUT)
+    name = stage_name(static_cast<redirect_cmd *>(cmd_)->cmd_);
+  else if (cmd_->type == CMD_TYPE_GROUP)
+    name = static_cast<group_cmd *>(cmd_)->body;
+  return name;
+}
+
+// run a pipeline stage in a child of this stage process, which counts it
+int session::run_counted_stage(cmd *stage) {
+  int fds[PERF_COUNTERS];
+  open_perf_counters(fds);
+  int pid = fork_wrap();
+  if (pid == 0)
+    exit(run_cmd(stage, true));
+  int wait_status;
+  wait_traced(pid, &wait_status, 0);
+  stage_counts &slot = stage_counters[min(pipe_index, STAGE_SLOTS - 1)];
+  long long values[PERF_COUNTERS];
+  read_perf_counters(fds, values);
+  for (int i = 0; i < PERF_COUNTERS; i++) // the last slot may be shared
+    slot.values[i] = values[i] < 0 ? -1 : slot.values[i] + values[i];
+  if (!slot.used) {
+    strncpy(slot.name, stage_name(stage).c_str(), sizeof(slot.name) - 1);
+    slot.used = true;
+  }
+  return exit_code(wait_status);
+}
+
+// time [-m] [-c] command_line
+// -m inserts a meter into every pipe of the pipeline
+// -c reports performance counters of the line and of each pipeline stage
+int session::builtin_time(string line) {
+  vector<string> argv = string_split(line, WHITE_SPACE);
+  string rest = trim(line.substr(4));
+  bool counters = false;
+  for (int i = 1; i < argv.size() && (argv[i] == "-m" || argv[i] == "-c");
+       i++) {
+    if (argv[i] == "-m")
+      pipe_meter = true;
+    else
+      counters = true;
+    rest = trim(rest.substr(2));
+  }
+  int fds[PERF_COUNTERS];
+  if (counters) {
+    void *slots = mmap(NULL, STAGE_SLOTS * sizeof(stage_counts),
+                       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                       -1, 0); // zeroed
+    stage_counters = slots == MAP_FAILED ? NULL : (stage_counts *)slots;
+    open_perf_counters(fds);
+  }
+  double begin = now_seconds();
+  rusage usage;
+  int wait_status = run_line(rest, &usage);
+  double real = now_seconds() - begin;
+  pipe_meter = false;
+  double user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+  double sys = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+  char buf[128];
+  sprintf(buf, "real\t%dm%.3fs\nuser\t%dm%.3fs\nsys\t%dm%.3fs",
+          (int)real / 60, real - (int)real / 60 * 60, (int)user / 60,
+          user - (int)user / 60 * 60, (int)sys / 60, sys - (int)sys / 60 * 60);
+  cerr << buf << endl;
+  if (counters) {
+    long long values[PERF_COUNTERS];
+    read_perf_counters(fds, values);
+    print_perf_counters(values, "");
+    for (int i = 0; stage_counters != NULL && i < STAGE_SLOTS; i++)
+      if (stage_counters[i].used) {
+        cerr << "stage " << i + 1 << (i == STAGE_SLOTS - 1 ? "+" : "")
+             << ": " << stage_counters[i].name << endl;
+        print_perf_counters(stage_counters[i].values, "  ");
+      }
+    if (stage_counters != NULL)
+      munmap(stage_counters, STAGE_SLOTS * sizeof(stage_counts));
+    stage_counters = NULL;
+  }
+  int code = exit_code(wait_status);
+  return code == 0 ? 1 : -code; // fails as the line did
+}
+
+// set -o name[=value] / set +o name / set
+int session::builtin_set(string line) {
+  vector<string> argv = string_split(line, WHITE_SPACE);
+  if (argv.size() == 1) {
+    for (map<string, string>::iterator it = shell_options.begin();
+         it != shell_options.end(); it++)
+      cout << "set -o " << it->first
+           << (it->second.empty() ? "" : "=" + it->second) << endl;
+    return 1;
+  }
+  if (argv.size() != 3 || (argv[1] != "-o" && argv[1] != "+o")) {
+    panic("usage: set -o name[=value] | set +o name");
+    return -1;
+  }
+  string name = string_split_first(argv[2], "=");
+  if (argv[1] == "+o") {
+    if (name == "trace" && option_on(name))
+      finish_trace(shell_options[name]);
+    shell_options.erase(name);
+    if (name == "jobs")
+      close_jobserver();
+    return 1;
+  }
+  int eq = argv[2].find('=');
+  shell_options[name] = eq == string::npos ? "" : argv[2].substr(eq + 1);
+  if (name == "pin")
+    init_cpu_order();
+  if (name == "jobs") {
+    int slots = atoi(shell_options[name].c_str());
+    if (slots < 1) {
+      shell_options.erase(name);
+      panic("set: jobs needs a positive number");
+      return -1;
+    }
+    init_jobserver(slots);
+  }
+  if (name == "io" && shell_options[name] != "uring" &&
+      shell_options[name] != "rw") {
+    shell_options.erase(name);
+    panic("set: io is uring or rw");
+    return -1;
+  }
+  if (name == "io" && uring_io() && !uring_available())
+    cerr << "set: io_uring is not available, builtin stages use read/write"
+         << endl;
+  if (name == "state" && !loaded_state) { // take what an earlier shell saved
+    load_state(state_path());
+    loaded_state = true;
+  }
+  if (name == "trace") {
+    string &path = shell_options[name];
+    if (path.empty()) {
+      shell_options.erase(name);
+      panic("set: trace needs a file");
+      return -1;
+    }
+    if (!start_trace()) {
+      shell_options.erase(name);
+      panic("set: cannot trace");
+      return -1;
+    }
+    if (path[0] != '/') // written at exit, wherever the shell is then
+      path = cwd + "/" + path;
+  }
+  if (name == "profile" && fork_count == NULL) {
+    // shared, so that forks in children are counted too
+    void *count = mmap(NULL, sizeof(unsigned), PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (count == MAP_FAILED) {
+      shell_options.erase(name);
+      panic("set: cannot profile");
+      return -1;
+    }
+    fork_count = (unsigned *)count;
+    *fork_count = 0;
+  }
+  if (name == "agents" && agent_turn == NULL) {
+    // shared, so that children running `remote` take turns
+    void *turn = mmap(NULL, sizeof(unsigned), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    agent_turn = turn == MAP_FAILED ? NULL : (unsigned *)turn;
+    if (agent_turn != NULL)
+      *agent_turn = 0;
+  }
+  return 1;
+}
+
+// whether name is one of the commands of process_builtin_command
+bool is_builtin(const string &name) {
+  const char *builtins[] = {"cd",  "quit", "history", "time", "set",
+                            "jobs", "dag", "read",   "hash"};
+  for (int i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++)
+    if (name == builtins[i])
+      return true;
+  return false;
+}
+
+// read name... - read a line of stdin into environment variables,
+// split at blanks, the last one takes the rest of the line
+// reads a byte at a time, so nothing after the line is taken from stdin
+int session::builtin_read(string line) {
+  vector<string> names = string_split_protect(trim(line), WHITE_SPACE);
+  names.erase(names.begin());
+  if (names.empty())
+    names.push_back("REPLY");
+  string input;
+  char ch;
+  ssize_t n;
+  while ((n = read(fileno(stdin), &ch, 1)) == 1 && ch != '\n')
+    input += ch;
+  if (n != 1 && input.empty())
+    return -1; // end of input
+  for (int i = 0; i < names.size(); i++) {
+    input = trim(input);
+    int blank = input.find_first_of(WHITE_SPACE);
+    string value = i + 1 == names.size() || blank == string::npos
+                       ? input
+                       : input.substr(0, blank);
+    input = value.length() < input.length() ? input.substr(value.length()) : "";
+    set_env(names[i], value);
+  }
+  return 1;
+}
+
+// the exit code of what process_builtin_command returned
+int builtin_exit_code(int builtin_ret) {
+  return builtin_ret > 0 ? 0 : -builtin_ret;
+}
+
+// deal with builtin command
+// returns: 0-nothing_done, 1-success, -1-failure,
+// -n-failure with exit code n, for time passing on the code of its line
+int session::process_builtin_command(string line) {
+  // 1 - cd
+  if (line == "cd") {
+    chdir(home().c_str()); // single cd means cd ~
+    return 1;
+  } else if (line.substr(0, 2) == "cd") {
+    // replace ~ into home_dir
+    string arg1 = string_split(line, WHITE_SPACE)[1];
+    if (arg1.find("~") == 0)
+      line = "cd " + home() + arg1.substr(1);
+    // change directory
+    int chdir_ret = chdir(trim(line.substr(2)).c_str());
+    if (chdir_ret < 0) {
+      panic("chdir failed");
+      return -1;
+    } else
+      return 1; // successfully processed
+  }
+  // 2 - quit
+  if (line == "quit") {
+    finished = true;
+    return 1;
+  }
+  // 3 - history
+  if (line == "history") {
+    for (int i = cmd_history.size() - 1; i >= 0; i--)
+      cout << "\t" << i << "\t" << cmd_history.at(i) << endl;
+    return 1;
+  }
+  // 4 - time
+  if (line == "time" || line.substr(0, 5) == "time ")
+    return builtin_time(line);
+  // 5 - set
+  if (line == "set" || line.substr(0, 4) == "set ")
+    return builtin_set(line);
+  // 6 - jobs
+  if (line == "jobs" || line.substr(0, 5) == "jobs ")
+    return builtin_jobs(line);
+  // 7 - dag
+  if (line == "dag" || line.substr(0, 4) == "dag ")
+    return builtin_dag(line);
+  // 8 - read
+  if (line == "read" || line.substr(0, 5) == "read ")
+    return builtin_read(line);
+  // 9 - hash
+  if (line == "hash" || line.substr(0, 5) == "hash ")
+    return builtin_hash(line);
+  return 0; // nothing done
+}
+
+// take the next cpus of cpu_order for a pipeline of pcmd,
+// so that pipelines running at the same time do not share their first cpus
+void session::reserve_cpus(pipe_cmd *pcmd) {
+  int stages = 2;
+  for (cmd *rest = pcmd->right; rest->type == CMD_TYPE_PIPE;
+       rest = static_cast<pipe_cmd *>(rest)->right)
+    stages++;
+  pin_base = pin_turn ? __sync_fetch_and_add(pin_turn, stages) : 0;
+}
+
+// run some cmd
+// returns the exit code of it, or of the last stage for a pipe
+// with tail, the process is done after cmd_, so the last command replaces it
+// instead of being forked and waited for
+int session::run_cmd(cmd *cmd_, bool tail) {
+  switch (cmd_->type) {
+  case CMD_TYPE_EXEC: {
+    exec_cmd *ecmd = static_cast<exec_cmd *>(cmd_);
+    // process alias
+    if (!alias_loaded)
+      init_alias();
+    if (alias_map.count(ecmd->argv[0]) != 0) {
+      vector<string> arg0_replace =
+          string_split(alias_map.at(ecmd->argv[0]), WHITE_SPACE);
+      ecmd->argv.erase(ecmd->argv.begin());
+      for (vector<string>::reverse_iterator it = arg0_replace.rbegin();
+           it < arg0_replace.rend(); it++) {
+        ecmd->argv.insert(ecmd->argv.begin(), (*it));
+      }
+    }
+    // skip blank string
+    vector<string> args = stage_args(ecmd);
+    // pin cpu_list command...
+    if (args.size() >= 2 && args[0] == "pin") {
+      cpu_set_t set;
+      if (!parse_cpu_list(args[1], &set))
+        panic("pin: bad cpu list " + args[1], true, 1);
+      if (sched_setaffinity(0, sizeof(set), &set) < 0)
+        panic("pin: sched_setaffinity failed", true, 1);
+      args.erase(args.begin(), args.begin() + 2);
+    }
+    if (args.empty())
+      return 0;
+    if (trace != NULL) {
+      string line;
+      for (int i = 0; i < args.size(); i++)
+        line += (i ? " " : "") + args[i];
+      trace_record('e', getpid(), getpgrp(), pipe_index, trace_clock(), 0,
+                   line);
+    }
+    // builtins of the session in a pipeline, they only change this child
+    if (is_builtin(args[0])) {
+      string line;
+      for (int i = 0; i < args.size(); i++)
+        line += args[i] + " ";
+      exit(builtin_exit_code(process_builtin_command(trim(line))));
+    }
+    // builtin stages run here instead of being exec-ed
+    int builtin_ret = run_builtin_stage(args);
+    if (builtin_ret >= 0)
+      exit(builtin_ret);
+    // prepare vector<string> for execvp
+    vector<char *> argv_c_str;
+    for (int i = 0; i < args.size(); i++) {
+      char *tmp = new char[MAX_ARGV_LEN];
+      strcpy(tmp, args[i].c_str());
+      argv_c_str.push_back(tmp);
+    }
+    argv_c_str.push_back(NULL);
+    char **argv_c_arr = &argv_c_str[0];
+    inherit_jobserver(); // make and the like take tokens from it
+    exec_hashed(argv_c_arr); // returns if not hashed or failed
+    // vscode made wrong marco expansion here
+    // second argument is ok for char** rather than char *const (*(*)())[]
+    int execvp_ret = execvp(argv_c_arr[0], argv_c_arr);
+    if (execvp_ret < 0)
+      panic("execvp failed");
+    return 127;
+  }
+  case CMD_TYPE_PIPE: {
+    pipe_cmd *pcmd = static_cast<pipe_cmd *>(cmd_);
+    fuse_filter_stages(pcmd);
+    if (pcmd->right == NULL) // all of it is fused
+      return run_cmd(pcmd->left, tail);
+    if (pipe_index == 0 && option_on("pin"))
+      reserve_cpus(pcmd);
+    int pipe_fd[2]; // r/w pipe file descriptor
+    pipe_wrap(pipe_fd);
+    // with a meter, lhs -> pipe_fd -> meter -> meter_fd -> rhs
+    int meter_fd[2] = {-1, -1};
+    if (pipe_meter)
+      pipe_wrap(meter_fd);
+    int rhs_read = pipe_meter ? meter_fd[0] : pipe_fd[0];
+    // fork twice to run lhs and rhs of pipe
+    int lhs_pid = fork_wrap();
+    if (lhs_pid == 0) {
+      // i'm a child, let's satisfy lhs
+      close(pipe_fd[0]);
+      dup2_wrap(pipe_fd[1], fileno(stdout)); // lhs_stdout -> pipe_write
+      // close the original ones
+      if (pipe_meter) {
+        close(meter_fd[0]);
+        close(meter_fd[1]);
+      }
+      if (option_on("pin"))
+        pin_stage(pipe_index);
+      int lhs_ret = stage_counters ? run_counted_stage(pcmd->left)
+                                   : run_cmd(pcmd->left, true);
+      close(pipe_fd[1]);
+      exit(lhs_ret);
+    }
+    int meter_pid = pipe_meter ? fork_wrap() : -1;
+    if (meter_pid == 0) {
+      // i'm the meter between lhs and rhs
+      close(pipe_fd[1]);
+      close(meter_fd[0]);
+      char label[32];
+      sprintf(label, "pipe %d", pipe_index + 1);
+      meter_forward(pipe_fd[0], meter_fd[1], label);
+      exit(0);
+    }
+    int rhs_pid = fork_wrap();
+    if (rhs_pid == 0) {
+      // i'm also a child, let's satisfy rhs
+      close(pipe_fd[1]);
+      if (pipe_meter) {
+        close(pipe_fd[0]);
+        close(meter_fd[1]);
+      }
+      dup2_wrap(rhs_read, fileno(stdin)); // pipe_read -> rhs_stdin
+      stdin_given = true;
+      pipe_index++;
+      if (option_on("pin") && pcmd->right->type != CMD_TYPE_PIPE)
+        pin_stage(pipe_index);
+      int rhs_ret = stage_counters && pcmd->right->type != CMD_TYPE_PIPE
+                        ? run_counted_stage(pcmd->right)
+                        : run_cmd(pcmd->right, true);
+      close(rhs_read);
+      exit(rhs_ret);
+    }
+    // really good. now we have lhs_stdout -> pipe -> rhs_stdin
+    // if fork > 0, then i'm the father
+    // let's wait for my children
+    close(pipe_fd[0]);
+    close(pipe_fd[1]);
+    if (pipe_meter) {
+      close(meter_fd[0]);
+      close(meter_fd[1]);
+    }
+    int wait_status_1, wait_status_2;
+    wait_traced(lhs_pid, &wait_status_1, 0);
+    wait_traced(rhs_pid, &wait_status_2, 0);
+    check_wait_status(wait_status_1);
+    check_wait_status(wait_status_2);
+    if (pipe_meter) {
+      int wait_status_3;
+      wait_traced(meter_pid, &wait_status_3, 0);
+    }
+    return exit_code(wait_status_2);
+  }
+  case CMD_TYPE_REDIR_IN:
+  case CMD_TYPE_REDIR_OUT: {
+    redirect_cmd *rcmd = static_cast<redirect_cmd *>(cmd_);
+    int pid = tail ? 0 : fork_wrap();
+    if (pid == 0) {
+      // i'm a child, let's satisfy the file being redirected to (or from)
+      rcmd->fd = open_wrap(rcmd->file.c_str(), rcmd->type == CMD_TYPE_REDIR_IN
+                                                   ? REDIR_IN_OFLAG
+                                                   : REDIR_OUT_OFLAG);
+      dup2_wrap(rcmd->fd, rcmd->type == CMD_TYPE_REDIR_IN ? fileno(stdin)
+                                                          : fileno(stdout));
+      stdin_given = stdin_given || rcmd->type == CMD_TYPE_REDIR_IN;
+      int ret = run_cmd(rcmd->cmd_, true);
+      close(rcmd->fd);
+      exit(ret);
+    }
+    // if fork > 0, then i'm the father
+    // let's wait for my children
+    int wait_status;
+    wait_traced(pid, &wait_status, 0);
+    check_wait_status(wait_status);
+    return exit_code(wait_status);
+  }
+  case CMD_TYPE_FUSED:
+    return run_fused_stages(static_cast<fused_cmd *>(cmd_), uring_io());
+  case CMD_TYPE_GROUP: {
+    // in a child already, so a { list; } is as good as a subshell here
+    group_cmd *gcmd = static_cast<group_cmd *>(cmd_);
+    int pid = tail ? 0 : fork_wrap();
+    if (pid == 0)
+      exit(exec_line(gcmd->body));
+    int wait_status;
+    wait_traced(pid, &wait_status, 0);
+    return exit_code(wait_status);
+  }
+  default:
+    panic("unknown or null cmd type", true, 1);
+  }
+  return 1;
+}
+
+// run argv as if it was typed as a single command
+int session::run_argv(vector<string> &argv) {
+  exec_cmd ecmd(argv);
+  return run_cmd(&ecmd);
+}
+
+// fork a new me to execute the command line, returns its pid
+// with own_group, it leads a new process group so it can be killed as a whole
+int session::spawn_line(string line, bool own_group) {
+  int pid = fork_wrap();
+  if (pid == 0) {
+    if (own_group)
+      setpgid(0, 0);
+    apply_env(); // jobs may be started between lines
+    exit(exec_line(line)); // child exit
+  }
+  return pid;
+}
+
+// run a line in a child of the shell, which is done after it
+// builtins of a list run in the child, its last command replaces the child
+int session::exec_line(const string &line) {
+  job_table.clear(); // those are children of the shell, not ours
+  vector<string> ops;
+  vector<string> commands = split_list(line, ops);
+  int status = 0;
+  for (int i = 0; i < commands.size() && !finished; i++) {
+    if (i > 0 && !list_continues(ops[i - 1], status))
+      continue;
+    int builtin_ret = process_builtin_command(commands[i]);
+    if (builtin_ret != 0) {
+      status = builtin_exit_code(builtin_ret);
+      continue;
+    }
+    string &command = commands[i];
+    if (command[command.length() - 1] == '&') { // not waited for
+      spawn_line(trim(command.substr(0, command.length() - 1)));
+      status = 0;
+      continue;
+    }
+    if (i + 1 < commands.size()) {
+      status = exit_code(run_line(commands[i], NULL));
+      continue;
+    }
+    cout.flush(); // nothing flushes it after exec
+    cmd *cmd_ = parse(commands[i]);
+    return run_cmd(cmd_, true);
+  }
+  return status;
+}
+
+// ==========================
+// background jobs and make jobserver
+// ==========================
+void session::close_jobserver() {
+  if (jobserver_fd[0] < 0)
+    return;
+  close(jobserver_fd[0]);
+  close(jobserver_fd[1]);
+  close(jobserver_try_fd);
+  jobserver_fd[0] = jobserver_fd[1] = jobserver_try_fd = -1;
+  unset_env("MAKEFLAGS");
+  for (int i = 0; i < job_table.size(); i++)
+    job_table[i].has_token = job_table[i].implicit_token = false;
+  implicit_token_lent = false;
+}
+
+void session::init_jobserver(int slots) {
+  close_jobserver();
+  // close-on-exec, as sessions sharing a process must not hand their tokens
+  // to each other's commands, see inherit_jobserver
+  if (pipe2(jobserver_fd, O_CLOEXEC) < 0)
+    panic("pipe failed", true, 1);
+  for (int i = 1; i < slots; i++)
+    write(jobserver_fd[1], "+", 1);
+  // reopen the read end through /proc to get a separate open file
+  // description, so O_NONBLOCK does not leak into make
+  char path[64];
+  sprintf(path, "/proc/self/fd/%d", jobserver_fd[0]);
+  jobserver_try_fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  if (jobserver_try_fd < 0)
+    panic("jobserver: cannot reopen token pipe", true, 1);
+  // make >= 4.2 reads --jobserver-auth, older make --jobserver-fds
+  char flags[128];
+  sprintf(flags, " -j%d --jobserver-fds=%d,%d --jobserver-auth=%d,%d", slots,
+          jobserver_fd[0], jobserver_fd[1], jobserver_fd[0], jobserver_fd[1]);
+  set_env("MAKEFLAGS", flags);
+}
+
+// let the command about to be exec-ed in this process keep the token pipe
+void session::inherit_jobserver() {
+  for (int i = 0; i < 2; i++)
+    if (jobserver_fd[i] >= 0)
+      fcntl(jobserver_fd[i], F_SETFD, 0);
+}
+
+// take a token without blocking, always succeeds without a jobserver
+bool session::acquire_token() {
+  if (jobserver_try_fd < 0)
+    return true;
+  char token;
+  return read(jobserver_try_fd, &token, 1) == 1;
+}
+
+void session::release_token() {
+  if (jobserver_fd[1] >= 0)
+    write(jobserver_fd[1], "+", 1);
+}
+
+// "some avg10" of a /proc/pressure file, -1 if PSI is not available
+double read_pressure(const string &path) {
+  string some = read_file_line(path);
+  int p = some.find("avg10=");
+  return p == string::npos ? -1 : atof(some.c_str() + p + 6);
+}
+
+// check the load and pressure thresholds before spawning another job
+bool session::system_overloaded() {
+  char buf[128];
+  if (option_on("maxload")) {
+    double limit = atof(shell_options["maxload"].c_str());
+    double load = atof(read_file_line("/proc/loadavg").c_str()) /
+                  sysconf(_SC_NPROCESSORS_ONLN);
+    if (load > limit) {
+      sprintf(buf, "load %.2f per cpu > %.2f", load, limit);
+      throttle_reason = buf;
+      return true;
+    }
+  }
+  if (option_on("maxpressure")) {
+    double limit = atof(shell_options["maxpressure"].c_str());
+    const char *resources[] = {"cpu", "memory"};
+    for (int i = 0; i < 2; i++) {
+      double pressure =
+          read_pressure(string("/proc/pressure/") + resources[i]);
+      if (pressure > limit) {
+        sprintf(buf, "%s pressure %.1f%% > %.1f%%", resources[i], pressure,
+                limit);
+        throttle_reason = buf;
+        return true;
+      }
+    }
+  }
+  throttle_reason = "";
+  return false;
+}
+
+// spawn waiting jobs, in order, as long as there are tokens
+// and the system is not overloaded
+// like a dag worker, the first job runs on the shell's own token
+void session::schedule_jobs() {
+  for (int i = 0; i < job_table.size(); i++) {
+    job &job_ = job_table[i];
+    if (job_.pid != 0)
+      continue;
+    if (system_overloaded())
+      return;
+    bool implicit = jobserver_fd[0] >= 0 && !implicit_token_lent;
+    if (!implicit && !acquire_token())
+      return;
+    job_.implicit_token = implicit;
+    implicit_token_lent = implicit_token_lent || implicit;
+    job_.has_token = jobserver_fd[0] >= 0 && !implicit;
+    job_.pid = spawn_line(job_.line);
+#ifdef SYS_pidfd_open
+    job_.pid_fd = syscall(SYS_pidfd_open, job_.pid, 0);
+#endif
+    cout << "[" << job_.id << "] " << job_.pid << endl;
+  }
+}
+
+// a job process exited, returns false if pid is not a job
+bool session::finish_job(int pid, int wait_status) {
+  for (int i = 0; i < job_table.size(); i++) {
+    if (job_table[i].pid != pid)
+      continue;
+    if (job_table[i].has_token)
+      release_token();
+    if (job_table[i].implicit_token)
+      implicit_token_lent = false;
+    if (job_table[i].pid_fd >= 0)
+      close(job_table[i].pid_fd);
+    char buf[64];
+    if (WIFEXITED(wait_status) && WEXITSTATUS(wait_status) == 0)
+      sprintf(buf, "[%d]  Done\t", job_table[i].id);
+    else
+      sprintf(buf, "[%d]  Exit %d\t", job_table[i].id,
+              WIFEXITED(wait_status) ? WEXITSTATUS(wait_status)
+                                     : 128 + WTERMSIG(wait_status));
+    job_notices.push_back(buf + job_table[i].line);
+    job_table.erase(job_table.begin() + i);
+    schedule_jobs(); // a token may have been freed
+    return true;
+  }
+  return false;
+}
+
+// collect exited jobs without blocking
+void session::reap_jobs() {
+  for (int i = 0; i < job_table.size(); i++) {
+    int wait_status, pid = job_table[i].pid;
+    if (pid > 0 && wait_traced(pid, &wait_status, WNOHANG) == pid) {
+      finish_job(pid, wait_status);
+      i = -1; // the table changed, look again
+    }
+  }
+}
+
+// block until pid exits, leaving it to be reaped, and meanwhile finish the
+// jobs that end so waiting jobs get their slots
+// only pid and the jobs are waited for, not other children of the process
+void session::wait_beside_jobs(int pid) {
+  int pid_fd = -1;
+#ifdef SYS_pidfd_open
+  pid_fd = syscall(SYS_pidfd_open, pid, 0);
+#endif
+  while (true) {
+    vector<pollfd> pfds;
+    bool pidless = pid_fd < 0;
+    pollfd pfd;
+    pfd.fd = pid_fd;
+    pfd.events = POLLIN;
+    if (pid_fd >= 0)
+      pfds.push_back(pfd);
+    for (int i = 0; i < job_table.size(); i++) {
+      if (job_table[i].pid == 0)
+        continue;
+      if (job_table[i].pid_fd < 0)
+        pidless = true;
+      pfd.fd = job_table[i].pid_fd;
+      pfds.push_back(pfd);
+    }
+    // without pidfd (kernel < 5.3) fall back to checking now and then
+    int ready = poll(pfds.empty() ? NULL : &pfds[0], pfds.size(),
+                     pidless ? PIDLESS_POLL_MS : -1);
+    if (ready < 0 && errno != EINTR)
+      break;
+    reap_jobs();
+    siginfo_t info;
+    info.si_pid = 0;
+    // WNOWAIT: the caller reaps it, with its rusage
+    if (waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) < 0 ||
+        info.si_pid == pid)
+      break;
+  }
+  if (pid_fd >= 0)
+    close(pid_fd);
+}
+
+void session::queue_job(string line) {
+  job job_;
+  job_.id = job_table.empty() ? 1 : job_table.back().id + 1;
+  job_.pid = 0;
+  job_.pid_fd = -1;
+  job_.line = line;
+  job_.has_token = job_.implicit_token = false;
+  job_table.push_back(job_);
+  schedule_jobs();
+  if (job_table.back().pid == 0)
+    cout << "[" << job_.id << "] waiting for "
+         << (throttle_reason.empty() ? "a job slot" : throttle_reason) << endl;
+}
+
+// start the jobs still waiting for a slot or for the load to go down,
+// as the shell is about to end; running jobs are left to finish on their
+// own, like sh does
+#define JOB_POLL_MS 200
+
+void session::start_waiting_jobs() {
+  while (true) {
+    reap_jobs();
+    schedule_jobs();
+    int running = 0;
+    bool waiting = false;
+    for (int i = 0; i < job_table.size(); i++)
+      if (job_table[i].pid == 0)
+        waiting = true;
+      else if (running == 0)
+        running = job_table[i].pid;
+    if (!waiting)
+      return;
+    int wait_status;
+    // a slot frees up when a job ends, the load has to be looked at again
+    if (running == 0 || !throttle_reason.empty())
+      usleep(JOB_POLL_MS * 1000);
+    else if (wait_traced(running, &wait_status, 0) == running)
+      finish_job(running, wait_status);
+  }
+}
+
+void print_job(const job &job_, const string &throttle_reason) {
+  cout << "[" << job_.id << "]  " << (job_.pid ? "Running" : "Waiting")
+       << "\t" << job_.line << " &"
+       << (job_.pid || throttle_reason.empty() ? ""
+                                              : " (" + throttle_reason + ")")
+       << endl;
+}
+
+// ==========================
+// job resource view
+// jobs -v lists the processes of each job with cpu, rss, io and state,
+// jobs -t [secs] keeps refreshing it like top, until enter is pressed
+// or no job is left
+// a process is opened once, as a dirfd with its stat and io files, which
+// each refresh just preads; /proc is scanned only for processes not seen
+// yet, and those not of a job are remembered and skipped from then on
+// ==========================
+#define MONITOR_STAT_BUF 1024
+
+// bytes as 512, 1.5K, 20.3M ...
+string human_size(unsigned long long bytes) {
+  const char *units = "KMGTP";
+  char buf[32];
+  if (bytes < 1024) {
+    sprintf(buf, "%llu", bytes);
+    return buf;
+  }
+  double size = bytes / 1024.0;
+  int unit = 0;
+  while (size >= 1024 && unit < 4) {
+    size /= 1024;
+    unit++;
+  }
+  sprintf(buf, "%.1f%c", size, units[unit]);
+  return buf;
+}
+
+struct job_process {
+  int dir_fd, stat_fd, io_fd; // kept open across refreshes
+  int job_pid;                // the job it descends from
+  int ppid;
+  char state;
+  string name;
+  unsigned long long ticks, start_ticks; // cpu time and start, in clock ticks
+  long rss_pages;
+  unsigned long long read_bytes, write_bytes;
+  double cpu; // percent, since the last refresh or its start
+};
+
+class job_monitor {
+public:
+  map<int, job_process> processes;
+  set<int> foreign; // processes of no job
+  int proc_fd;
+  double hz, uptime; // of the refresh going on
+  double sampled;    // when processes were last refreshed, uptime seconds
+
+  job_monitor()
+      : proc_fd(open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC)), hz(100),
+        uptime(0), sampled(0) {}
+
+  ~job_monitor() {
+    for (map<int, job_process>::iterator it = processes.begin();
+         it != processes.end(); it++)
+      close_process(it->second);
+    close(proc_fd);
+  }
+
+  void close_process(job_process &process) {
+    close(process.stat_fd);
+    if (process.io_fd >= 0)
+      close(process.io_fd);
+    close(process.dir_fd);
+  }
+
+  // parse the stat file of a process, false if the process is gone
+  static bool parse_stat(job_process &process, int fd) {
+    char buf[MONITOR_STAT_BUF];
+    int n = pread(fd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0)
+      return false;
+    buf[n] = 0;
+    // the name is in parentheses and may have any of them inside
+    char *open_paren = strchr(buf, '('), *close_paren = strrchr(buf, ')');
+    if (open_paren == NULL || close_paren == NULL)
+      return false;
+    process.name = string(open_paren + 1, close_paren - open_paren - 1);
+    // fields from the 3rd on, 1-based as in proc(5)
+    vector<string> fields = string_split(close_paren + 2, " ");
+    if (fields.size() < 22)
+      return false;
+    process.state = fields[0][0];
+    process.ppid = atoi(fields[1].c_str());
+    process.ticks = strtoull(fields[11].c_str(), NULL, 10) +
+                    strtoull(fields[12].c_str(), NULL, 10);
+    process.start_ticks = strtoull(fields[19].c_str(), NULL, 10);
+    process.rss_pages = atol(fields[21].c_str());
+    return true;
+  }
+
+  static void parse_io(job_process &process) {
+    char buf[MONITOR_STAT_BUF];
+    int n = process.io_fd < 0
+                ? -1
+                : pread(process.io_fd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0)
+      return; // not allowed to, keep the last values
+    buf[n] = 0;
+    // everything read or written, pipes included, not only from disk
+    char *rchar = strstr(buf, "rchar:"), *wchar = strstr(buf, "wchar:");
+    if (rchar != NULL)
+      process.read_bytes = strtoull(rchar + 6, NULL, 10);
+    if (wchar != NULL)
+      process.write_bytes = strtoull(wchar + 6, NULL, 10);
+  }
+
+  // start watching pid, a process of the job job_pid
+  void add(int pid, int job_pid) {
+    char name[32];
+    sprintf(name, "%d", pid);
+    job_process process;
+    process.dir_fd = openat(proc_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (process.dir_fd < 0)
+      return;
+    process.stat_fd = openat(process.dir_fd, "stat", O_RDONLY | O_CLOEXEC);
+    process.io_fd = openat(process.dir_fd, "io", O_RDONLY | O_CLOEXEC);
+    process.job_pid = job_pid;
+    process.read_bytes = process.write_bytes = 0;
+    process.cpu = 0;
+    if (process.stat_fd < 0 || !parse_stat(process, process.stat_fd)) {
+      if (process.stat_fd >= 0)
+        close(process.stat_fd);
+      if (process.io_fd >= 0)
+        close(process.io_fd);
+      close(process.dir_fd);
+      return;
+    }
+    // new ones are measured over their lifetime
+    parse_io(process);
+    double age = uptime - process.start_ticks / hz;
+    process.cpu = age > 0 ? process.ticks / hz / age * 100 : 0;
+    processes[pid] = process;
+  }
+
+  // find the processes started since the last refresh
+  void discover(const vector<job> &jobs) {
+    set<int> job_pids;
+    for (int i = 0; i < jobs.size(); i++)
+      if (jobs[i].pid > 0)
+        job_pids.insert(jobs[i].pid);
+    map<int, int> fresh; // pid -> ppid
+    DIR *dir = fdopendir(dup(proc_fd));
+    if (dir == NULL)
+      return;
+    rewinddir(dir);
+    dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+      int pid = atoi(entry->d_name);
+      if (pid <= 0 || processes.count(pid) || foreign.count(pid))
+        continue;
+      char path[64];
+      sprintf(path, "%d/stat", pid);
+      int fd = openat(proc_fd, path, O_RDONLY | O_CLOEXEC);
+      job_process process;
+      if (fd >= 0 && parse_stat(process, fd))
+        fresh[pid] = process.ppid;
+      if (fd >= 0)
+        close(fd);
+    }
+    closedir(dir);
+    // parents may be among the fresh ones too, so go until nothing changes
+    for (bool changed = true; changed;) {
+      changed = false;
+      for (map<int, int>::iterator it = fresh.begin(); it != fresh.end();) {
+        int job_pid = job_pids.count(it->first) ? it->first
+                      : processes.count(it->second)
+                          ? processes[it->second].job_pid
+                          : 0;
+        if (job_pid == 0) {
+          it++;
+          continue;
+        }
+        add(it->first, job_pid);
+        fresh.erase(it++);
+        changed = true;
+      }
+    }
+    for (map<int, int>::iterator it = fresh.begin(); it != fresh.end(); it++)
+      foreign.insert(it->first);
+  }
+
+  void refresh(const vector<job> &jobs) {
+    hz = sysconf(_SC_CLK_TCK);
+    uptime = atof(read_file_line("/proc/uptime").c_str());
+    for (map<int, job_process>::iterator it = processes.begin();
+         it != processes.end();) {
+      job_process &process = it->second;
+      unsigned long long ticks = process.ticks;
+      if (!parse_stat(process, process.stat_fd)) { // gone
+        close_process(process);
+        processes.erase(it++);
+        continue;
+      }
+      parse_io(process);
+      double since = sampled > 0 ? uptime - sampled : 0;
+      process.cpu = since > 0 ? (process.ticks - ticks) / hz / since * 100 : 0;
+      it++;
+    }
+    discover(jobs);
+    sampled = uptime;
+  }
+
+  void print(const vector<job> &jobs, const string &throttle_reason) {
+    long page = sysconf(_SC_PAGESIZE);
+    for (int i = 0; i < jobs.size(); i++) {
+      print_job(jobs[i], throttle_reason);
+      if (jobs[i].pid == 0)
+        continue;
+      char buf[CHAR_BUF_SIZE];
+      sprintf(buf, "  %7s %s %6s %8s %8s %8s  %s", "PID", "S", "CPU%", "RSS",
+              "READ", "WRITE", "COMMAND");
+      cout << buf << endl;
+      for (map<int, job_process>::iterator it = processes.begin();
+           it != processes.end(); it++) {
+        job_process &process = it->second;
+        if (process.job_pid != jobs[i].pid)
+          continue;
+        sprintf(buf, "  %7d %c %6.1f %8s %8s %8s  %s", it->first,
+                process.state, process.cpu,
+                human_size((unsigned long long)process.rss_pages * page)
+                    .c_str(),
+                human_size(process.read_bytes).c_str(),
+                human_size(process.write_bytes).c_str(),
+                process.name.c_str());
+        cout << buf << endl;
+      }
+    }
+  }
+};
+
+// jobs [-v | -t [secs]]
+int session::builtin_jobs(string line) {
+  reap_jobs();
+  vector<string> argv = string_split(line, WHITE_SPACE);
+  if (argv.size() == 1) {
+    for (int i = 0; i < job_table.size(); i++)
+      print_job(job_table[i], throttle_reason);
+    return 1;
+  }
+  if (argv[1] != "-v" && argv[1] != "-t") {
+    panic("usage: jobs [-v | -t [secs]]");
+    return -1;
+  }
+  job_monitor monitor;
+  if (argv[1] == "-v") {
+    monitor.refresh(job_table);
+    monitor.print(job_table, throttle_reason);
+    return 1;
+  }
+  double interval = argv.size() > 2 ? atof(argv[2].c_str()) : 1;
+  if (interval <= 0)
+    interval = 1;
+  bool tty = isatty(fileno(stdin)), clear = isatty(fileno(stdout));
+  while (!job_table.empty()) {
+    monitor.refresh(job_table);
+    if (clear)
+      cout << "\033[H\033[2J";
+    monitor.print(job_table, throttle_reason);
+    cout.flush();
+    pollfd pfd;
+    pfd.fd = fileno(stdin);
+    pfd.events = POLLIN;
+    if (tty && poll(&pfd, 1, (int)(interval * 1000)) > 0) {
+      string rest;
+      getline(cin, rest); // enter ends it
+      break;
+    }
+    if (!tty)
+      usleep((useconds_t)(interval * 1e6));
+    reap_jobs();
+    schedule_jobs();
+  }
+  return 1;
+}
+
+// ==========================
+// dependency graph runner
+// runs the tasks of a task file in parallel, in dependency order
+// each line of the file is `name: dep1 dep2 ...: command`
+// ==========================
+#define DAG_WAITING 0
+#define DAG_RUNNING 1
+#define DAG_DONE 2
+#define DAG_FAILED 3
+#define DAG_SKIPPED 4
+
+struct dag_task {
+  string name;
+  string command;
+  vector<int> dependents;
+  int pending_deps; // dependencies not done yet
+  int priority;     // tasks on the longest path to the end, itself included
+  int state;
+  int pid;
+  int pid_fd; // to wait for it along with the others, -1 without pidfd
+  bool has_token;
+  double begin;
+};
+
+// wait until a running task exits, returns its index, -1 on error
+// only the tasks are waited for, not other children of the process
+int wait_dag_task(vector<dag_task> &tasks, int &wait_status) {
+  while (true) {
+    vector<pollfd> pfds;
+    vector<int> polled; // task of each pollfd
+    bool pidless = false;
+    for (int i = 0; i < tasks.size(); i++) {
+      if (tasks[i].state != DAG_RUNNING)
+        continue;
+      if (tasks[i].pid_fd < 0) {
+        pidless = true;
+        continue;
+      }
+      pollfd pfd;
+      pfd.fd = tasks[i].pid_fd;
+      pfd.events = POLLIN;
+      pfds.push_back(pfd);
+      polled.push_back(i);
+    }
+    if (pfds.empty() && !pidless)
+      return -1;
+    // without pidfd (kernel < 5.3) fall back to checking now and then
+    int ready = poll(pfds.empty() ? NULL : &pfds[0], pfds.size(),
+                     pidless ? PIDLESS_POLL_MS : -1);
+    if (ready < 0 && errno != EINTR)
+      return -1;
+    for (int i = 0; i < tasks.size(); i++) {
+      if (tasks[i].state != DAG_RUNNING)
+        continue;
+      if (tasks[i].pid_fd >= 0) {
+        int k = find(polled.begin(), polled.end(), i) - polled.begin();
+        if (ready <= 0 || pfds[k].revents == 0)
+          continue;
+      }
+      if (wait_traced(tasks[i].pid, &wait_status, WNOHANG) != tasks[i].pid)
+        continue;
+      if (tasks[i].pid_fd >= 0)
+        close(tasks[i].pid_fd);
+      return i;
+    }
+  }
+}
+
+// read the task file and compute the critical path priorities
+// returns false if it is malformed or has a cycle
+bool load_dag(const string &file, vector<dag_task> &tasks) {
+  ifstream in(file.c_str());
+  if (!in) {
+    panic("dag: cannot open " + file);
+    return false;
+  }
+  map<string, int> index;
+  vector<vector<string> > deps;
+  string line;
+  while (getline(in, line)) {
+    line = trim(line);
+    if (line.empty() || line[0] == '#')
+      continue;
+    int p = line.find(':'), q = p == string::npos ? p : line.find(':', p + 1);
+    if (q == string::npos) {
+      panic("dag: expected `name: deps: command` in " + line);
+      return false;
+    }
+    dag_task task;
+    task.name = trim(line.substr(0, p));
+    task.command = trim(line.substr(q + 1));
+    task.pending_deps = 0;
+    task.priority = 1;
+    task.state = DAG_WAITING;
+    task.pid = 0;
+    task.has_token = false;
+    if (task.name.empty() || index.count(task.name) != 0) {
+      panic("dag: empty or duplicate task name " + task.name);
+      return false;
+    }
+    index[task.name] = tasks.size();
+    tasks.push_back(task);
+    deps.push_back(string_split(line.substr(p + 1, q - p - 1), WHITE_SPACE));
+  }
+  for (int i = 0; i < tasks.size(); i++)
+    for (int j = 0; j < deps[i].size(); j++) {
+      if (index.count(deps[i][j]) == 0) {
+        panic("dag: " + tasks[i].name + " depends on unknown " + deps[i][j]);
+        return false;
+      }
+      tasks[index[deps[i][j]]].dependents.push_back(i);
+      tasks[i].pending_deps++;
+    }
+  // topological order, then priorities from the sinks backwards
+  vector<int> order, in_degree;
+  for (int i = 0; i < tasks.size(); i++) {
+    in_degree.push_back(tasks[i].pending_deps);
+    if (in_degree[i] == 0)
+      order.push_back(i);
+  }
+  for (int k = 0; k < order.size(); k++) {
+    dag_task &task = tasks[order[k]];
+    for (int j = 0; j < task.dependents.size(); j++)
+      if (--in_degree[task.dependents[j]] == 0)
+        order.push_back(task.dependents[j]);
+  }
+  if (order.size() != tasks.size()) {
+    panic("dag: dependency cycle");
+    return false;
+  }
+  for (int k = order.size() - 1; k >= 0; k--) {
+    dag_task &task = tasks[order[k]];
+    for (int j = 0; j < task.dependents.size(); j++)
+      task.priority = max(task.priority, tasks[task.dependents[j]].priority + 1);
+  }
+  return true;
+}
+
+// a task failed, skip everything depending on it
+void skip_dependents(vector<dag_task> &tasks, int failed) {
+  for (int j = 0; j < tasks[failed].dependents.size(); j++) {
+    int dependent = tasks[failed].dependents[j];
+    if (tasks[dependent].state != DAG_WAITING)
+      continue;
+    tasks[dependent].state = DAG_SKIPPED;
+    cout << "[dag] skip " << tasks[dependent].name << endl;
+    skip_dependents(tasks, dependent);
+  }
+}
+
+// dag [-j N] [-k] file
+// -j bounds the workers, by default the jobserver slots or the cpu count
+// -k keeps going after a failure instead of stopping to spawn tasks
+int session::builtin_dag(string line) {
+  vector<string> argv = string_split(line, WHITE_SPACE);
+  int slots = option_on("jobs") ? atoi(shell_options["jobs"].c_str())
+                                : sysconf(_SC_NPROCESSORS_ONLN);
+  bool keep_going = false;
+  string file;
+  for (int i = 1; i < argv.size(); i++) {
+    if (argv[i] == "-k")
+      keep_going = true;
+    else if (argv[i] == "-j" && i + 1 < argv.size())
+      slots = atoi(argv[++i].c_str());
+    else
+      file = argv[i];
+  }
+  if (file.empty() || slots < 1) {
+    panic("usage: dag [-j N] [-k] file");
+    return -1;
+  }
+  vector<dag_task> tasks;
+  if (!load_dag(file, tasks))
+    return -1;
+  // the first worker runs on the shell's own token, unless a background job
+  // has it, more workers need one from the jobserver
+  bool implicit_free = !implicit_token_lent;
+  int running = 0, failures = 0;
+  while (true) {
+    while (running < slots && (failures == 0 || keep_going)) {
+      int next = -1;
+      for (int i = 0; i < tasks.size(); i++)
+        if (tasks[i].state == DAG_WAITING && tasks[i].pending_deps == 0 &&
+            (next < 0 || tasks[i].priority > tasks[next].priority))
+          next = i;
+      if (next < 0)
+        break;
+      if (!implicit_free && (system_overloaded() || !acquire_token())) {
+        if (running > 0 || !implicit_token_lent)
+          break;
+        // background jobs hold every slot, wait for the one on the shell's
+        // own token to hand it back
+        int job_pid = 0, job_status;
+        for (int i = 0; i < job_table.size() && job_pid == 0; i++)
+          if (job_table[i].implicit_token)
+            job_pid = job_table[i].pid;
+        if (wait_traced(job_pid, &job_status, 0) != job_pid)
+          break;
+        finish_job(job_pid, job_status);
+        implicit_free = !implicit_token_lent;
+        continue;
+      }
+      dag_task &task = tasks[next];
+      task.has_token = !implicit_free;
+      implicit_free = false;
+      task.state = DAG_RUNNING;
+      task.begin = now_seconds();
+      task.pid = spawn_line(task.command);
+      task.pid_fd = -1;
+#ifdef SYS_pidfd_open
+      task.pid_fd = syscall(SYS_pidfd_open, task.pid, 0);
+#endif
+      running++;
+      cout << "[dag] start " << task.name << endl;
+    }
+    if (running == 0)
+      break;
+    int wait_status;
+    int done = wait_dag_task(tasks, wait_status);
+    if (done < 0)
+      break;
+    dag_task &task = tasks[done];
+    running--;
+    if (task.has_token)
+      release_token();
+    else
+      implicit_free = true;
+    char buf[64];
+    int code = exit_code(wait_status);
+    if (code == 0) {
+      task.state = DAG_DONE;
+      for (int j = 0; j < task.dependents.size(); j++)
+        tasks[task.dependents[j]].pending_deps--;
+      sprintf(buf, " (%.2fs)", now_seconds() - task.begin);
+      cout << "[dag] done " << task.name << buf << endl;
+    } else {
+      task.state = DAG_FAILED;
+      failures++;
+      sprintf(buf, " (exit %d)", code);
+      cout << "[dag] failed " << task.name << buf << endl;
+      if (keep_going)
+        skip_dependents(tasks, done);
+    }
+  }
+  int count[5] = {0, 0, 0, 0, 0};
+  for (int i = 0; i < tasks.size(); i++)
+    count[tasks[i].state]++;
+  char buf[128];
+  sprintf(buf, "[dag] %d done, %d failed, %d skipped, %d not run",
+          count[DAG_DONE], count[DAG_FAILED], count[DAG_SKIPPED],
+          count[DAG_WAITING]);
+  cout << buf << endl;
+  return failures == 0 ? 1 : -1;
+}
+
+// ==========================
+// incremental mode
+// `cmd < in > out` is skipped when out is newer than its inputs and neither
+// the command text nor the inputs changed since it last succeeded
+// ==========================
+// files read (< and file arguments) and written (>) by the command line
+void collect_files(cmd *cmd_, vector<string> &inputs, vector<string> &outputs) {
+  switch (cmd_->type) {
+  case CMD_TYPE_EXEC: {
+    exec_cmd *ecmd = static_cast<exec_cmd *>(cmd_);
+    for (int i = 1; i < ecmd->argv.size(); i++) {
+      struct stat st;
+      string arg = trim(ecmd->argv[i]);
+      if (arg.length() > 0 && stat(arg.c_str(), &st) == 0 &&
+          S_ISREG(st.st_mode))
+        inputs.push_back(arg);
+    }
+    break;
+  }
+  case CMD_TYPE_PIPE: {
+    pipe_cmd *pcmd = static_cast<pipe_cmd *>(cmd_);
+    collect_files(pcmd->left, inputs, outputs);
+    collect_files(pcmd->right, inputs, outputs);
+    break;
+  }
+  case CMD_TYPE_REDIR_IN:
+  case CMD_TYPE_REDIR_OUT: {
+    redirect_cmd *rcmd = static_cast<redirect_cmd *>(cmd_);
+    (cmd_->type == CMD_TYPE_REDIR_IN ? inputs : outputs).push_back(rcmd->file);
+    collect_files(rcmd->cmd_, inputs, outputs);
+    break;
+  }
+  }
+}
+
+string session::incremental_db_path() {
+  string path = shell_options["incremental"];
+  return path.empty() ? home() + "/.expshell/incremental.db" : path;
+}
+
+// fingerprint of line from its text and the mtime and size of its inputs
+// returns false if line has no output file or an input is missing,
+// otherwise up_to_date tells whether it can be skipped
+bool session::fingerprint_line(const string &line, hash_t &fingerprint,
+                      bool &up_to_date) {
+  vector<string> inputs, outputs;
+  cmd *tree = parse(line);
+  collect_files(tree, inputs, outputs);
+  free_cmd(tree);
+  if (outputs.empty())
+    return false;
+  fingerprint = hash_string(FNV_OFFSET, line);
+  timespec newest_input = {0, 0};
+  for (int i = 0; i < inputs.size(); i++) {
+    if (find(outputs.begin(), outputs.end(), inputs[i]) != outputs.end())
+      continue; // it is written too, e.g. `sort f > f`
+    struct stat st;
+    if (stat(inputs[i].c_str(), &st) != 0)
+      return false;
+    char buf[64];
+    sprintf(buf, "%ld.%09ld %lld", (long)st.st_mtim.tv_sec,
+            (long)st.st_mtim.tv_nsec, (long long)st.st_size);
+    fingerprint = hash_string(hash_string(fingerprint, inputs[i]), buf);
+    if (st.st_mtim.tv_sec > newest_input.tv_sec ||
+        (st.st_mtim.tv_sec == newest_input.tv_sec &&
+         st.st_mtim.tv_nsec > newest_input.tv_nsec))
+      newest_input = st.st_mtim;
+  }
+  up_to_date = true;
+  for (int i = 0; i < outputs.size() && up_to_date; i++) {
+    struct stat st;
+    up_to_date = stat(outputs[i].c_str(), &st) == 0 &&
+                 (st.st_mtim.tv_sec > newest_input.tv_sec ||
+                  (st.st_mtim.tv_sec == newest_input.tv_sec &&
+                   st.st_mtim.tv_nsec >= newest_input.tv_nsec));
+  }
+  if (up_to_date) {
+    // the database maps the hash of the line to its last fingerprint
+    ifstream db(incremental_db_path().c_str());
+    string line_key = hash_hex(hash_string(FNV_OFFSET, line)), key, value;
+    up_to_date = false;
+    while (db >> key >> value)
+      if (key == line_key)
+        up_to_date = value == hash_hex(fingerprint);
+  }
+  return true;
+}
+
+// remember the fingerprint of a line that succeeded
+void session::record_fingerprint(const string &line, hash_t fingerprint) {
+  string path = incremental_db_path();
+  make_dirs(path.substr(0, path.rfind('/')));
+  map<string, string> entries;
+  ifstream db(path.c_str());
+  string key, value;
+  while (db >> key >> value)
+    entries[key] = value;
+  db.close();
+  entries[hash_hex(hash_string(FNV_OFFSET, line))] = hash_hex(fingerprint);
+  string tmp_path = path + ".tmp";
+  ofstream out(tmp_path.c_str());
+  for (map<string, string>::iterator it = entries.begin();
+       it != entries.end(); it++)
+    out << it->first << " " << it->second << endl;
+  out.close();
+  rename(tmp_path.c_str(), path.c_str());
+}
+
+// ==========================
+// command hash
+// the shell looks up the path of a command once, and keeps the binaries
+// it runs most open as O_PATH fds, so children exec them with execveat
+// without walking PATH; entries are checked before each run
+// ==========================
+#define HOT_COMMANDS 32 // O_PATH fds kept open
+
+// the first executable file named name in PATH, empty if none
+string find_in_path(const string &name) {
+  const char *path_env = getenv("PATH");
+  vector<string> dirs = string_split(path_env ? path_env : "", ":");
+  for (int i = 0; i < dirs.size(); i++) {
+    string path = (dirs[i].empty() ? "." : dirs[i]) + "/" + name;
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode) &&
+        access(path.c_str(), X_OK) == 0)
+      return path;
+  }
+  return "";
+}
+
+// whether entry still names the file it was hashed for
+// an open one is checked by fstat, without a path walk: a binary replaced
+// by rename or removed has no links left
+bool hash_entry_valid(const hashed_command &entry) {
+  struct stat st;
+  if (entry.fd >= 0)
+    return fstat(entry.fd, &st) == 0 && st.st_nlink > 0;
+  return stat(entry.path.c_str(), &st) == 0 && st.st_ino == entry.ino &&
+         st.st_dev == entry.dev;
+}
+
+void session::forget_commands() {
+  for (map<string, hashed_command>::iterator it = command_hash.begin();
+       it != command_hash.end(); it++)
+    if (it->second.fd >= 0)
+      close(it->second.fd);
+  command_hash.clear();
+}
+
+// look up name, or check that it is still the same file, and open it
+void session::hash_command(const string &name) {
+  if (name.empty() || name.find('/') != string::npos || is_builtin(name) ||
+      is_builtin_stage(name))
+    return;
+  const char *path_env = getenv("PATH");
+  if (hashed_path_env != (path_env ? path_env : "")) {
+    forget_commands(); // PATH changed
+    hashed_path_env = path_env ? path_env : "";
+  }
+  struct stat st;
+  map<string, hashed_command>::iterator it = command_hash.find(name);
+  if (it != command_hash.end() && !hash_entry_valid(it->second)) {
+    if (it->second.fd >= 0) // replaced, or gone
+      close(it->second.fd);
+    command_hash.erase(it);
+    it = command_hash.end();
+  }
+  if (it == command_hash.end()) {
+    hashed_command entry;
+    entry.path = find_in_path(name);
+    if (entry.path.empty() || stat(entry.path.c_str(), &st) != 0)
+      return;
+    entry.dev = st.st_dev;
+    entry.ino = st.st_ino;
+    entry.fd = -1;
+    entry.uses = 0;
+    it = command_hash.insert(make_pair(name, entry)).first;
+  }
+  hashed_command &entry = it->second;
+  entry.uses++;
+  entry.last_use = ++hash_clock;
+  if (entry.fd >= 0)
+    return;
+  // keep the HOT_COMMANDS most used open: the least used one, of those
+  // the least recent, makes room unless it is used more than this one
+  int open_fds = 0;
+  map<string, hashed_command>::iterator coldest = command_hash.end();
+  for (map<string, hashed_command>::iterator i = command_hash.begin();
+       i != command_hash.end(); i++) {
+    if (i->second.fd < 0)
+      continue;
+    open_fds++;
+    if (coldest == command_hash.end() ||
+        i->second.uses < coldest->second.uses ||
+        (i->second.uses == coldest->second.uses &&
+         i->second.last_use < coldest->second.last_use))
+      coldest = i;
+  }
+  if (open_fds >= HOT_COMMANDS) {
+    if (coldest->second.uses > entry.uses)
+      return;
+    close(coldest->second.fd);
+    coldest->second.fd = -1;
+  }
+  entry.fd = open(entry.path.c_str(), O_PATH | O_CLOEXEC);
+}
+
+// hash the commands a line runs, before forking for it
+void session::hash_line(const string &line) {
+  vector<string> ops;
+  vector<string> commands = split_list(line, ops);
+  for (int i = 0; i < commands.size(); i++) {
+    cmd *tree = parse(commands[i]);
+    vector<cmd *> todo(1, tree);
+    while (!todo.empty()) {
+      cmd *cmd_ = todo.back();
+      todo.pop_back();
+      if (cmd_->type == CMD_TYPE_PIPE) {
+        todo.push_back(static_cast<pipe_cmd *>(cmd_)->left);
+        todo.push_back(static_cast<pipe_cmd *>(cmd_)->right);
+      } else if (cmd_->type & (CMD_TYPE_REDIR_IN | CMD_TYPE_REDIR_OUT))
+        todo.push_back(static_cast<redirect_cmd *>(cmd_)->cmd_);
+      else if (cmd_->type == CMD_TYPE_GROUP)
+        hash_line(static_cast<group_cmd *>(cmd_)->body);
+      else if (cmd_->type == CMD_TYPE_EXEC) {
+        vector<string> args = stage_args(static_cast<exec_cmd *>(cmd_));
+        if (args.size() > 2 && args[0] == "pin")
+          args.erase(args.begin(), args.begin() + 2);
+        if (args.empty())
+          continue;
+        if (!alias_loaded)
+          init_alias();
+        if (alias_map.count(args[0]) != 0)
+          args[0] = string_split_first(alias_map[args[0]], WHITE_SPACE);
+        hash_command(args[0]);
+      }
+    }
+    free_cmd(tree);
+  }
+}
+
+// exec argv by its hashed fd, returns only if it is not hashed or failed
+void session::exec_hashed(char **argv) {
+  map<string, hashed_command>::iterator it = command_hash.find(argv[0]);
+  if (it == command_hash.end())
+    return;
+#ifdef SYS_execveat
+  if (it->second.fd >= 0)
+    syscall(SYS_execveat, it->second.fd, "", argv, environ, AT_EMPTY_PATH);
+#endif
+  // a #! script cannot be run from a close-on-exec fd, go by the path
+  execv(it->second.path.c_str(), argv);
+}
+
+// hash [-r] - show the command hash, or forget it with -r
+int session::builtin_hash(string line) {
+  if (trim(line) == "hash -r") {
+    forget_commands();
+    return 1;
+  }
+  for (map<string, hashed_command>::iterator it = command_hash.begin();
+       it != command_hash.end(); it++)
+    cout << it->second.uses << "\t" << it->first << "\t" << it->second.path
+         << (it->second.fd >= 0 ? "" : " (closed)") << endl;
+  return 1;
+}
+
+// ==========================
+// warm start
+// set -o state[=FILE] saves the command hash with its usage counts,
+// aliases and history when the shell ends, ~/.expshell/state by default;
+// an interactive shell loads the state file, if any, as it starts
+// the hash is only taken if PATH and the mtimes of its directories match
+// ==========================
+#define STATE_MAGIC "expshell-state 1"
+#define STATE_HISTORY 1000 // lines of history kept
+
+string session::state_path() {
+  string path = shell_options["state"];
+  return path.empty() ? home() + "/.expshell/state" : path;
+}
+
+// mtimes of the PATH directories, as saved in the state file
+string path_dir_stamps(const string &path_env) {
+  vector<string> dirs = string_split(path_env, ":");
+  string stamps;
+  for (int i = 0; i < dirs.size(); i++) {
+    struct stat st;
+    char stamp[64];
+    if (stat(dirs[i].c_str(), &st) != 0)
+      st.st_mtim.tv_sec = st.st_mtim.tv_nsec = 0;
+    sprintf(stamp, "%ld.%09ld", (long)st.st_mtim.tv_sec,
+            (long)st.st_mtim.tv_nsec);
+    stamps += dirs[i] + "\t" + stamp + "\t";
+  }
+  return stamps;
+}
+
+bool session::load_state(const string &path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+    if (fd >= 0)
+      close(fd);
+    return false;
+  }
+  // mapped, so lines are taken from the page cache without copying it all
+  char *data =
+      (char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return false;
+  const char *path_env = getenv("PATH");
+  string current_path = path_env ? path_env : "";
+  bool hash_valid = false;
+  char *end = data + st.st_size;
+  for (char *line = data; line < end;) {
+    char *eol = (char *)memchr(line, '\n', end - line);
+    if (eol == NULL)
+      eol = end;
+    string entry(line, eol - line);
+    line = eol + 1;
+    int tab = entry.find('\t');
+    string kind = entry.substr(0, tab), rest = entry.substr(tab + 1);
+    if (kind == STATE_MAGIC || tab == string::npos)
+      continue;
+    if (kind == "path") // the rest is PATH, then its directory stamps
+      hash_valid = rest == current_path + "\t" + path_dir_stamps(current_path);
+    else if (kind == "cmd" && hash_valid) {
+      // uses, dev, ino, name, path
+      vector<string> fields = string_split(rest, "\t");
+      if (fields.size() != 5)
+        continue;
+      hashed_command command;
+      command.uses = atol(fields[0].c_str());
+      command.dev = strtoull(fields[1].c_str(), NULL, 10);
+      command.ino = strtoull(fields[2].c_str(), NULL, 10);
+      command.path = fields[4];
+      command.fd = -1; // opened when it runs
+      command.last_use = 0;
+      command_hash[fields[3]] = command;
+      hashed_path_env = current_path;
+    } else if (kind == "alias") {
+      int sep = rest.find('\t');
+      if (!alias_loaded)
+        init_alias();
+      if (sep != string::npos)
+        alias_map[rest.substr(0, sep)] = rest.substr(sep + 1);
+    } else if (kind == "history")
+      cmd_history.push_back(rest);
+  }
+  munmap(data, st.st_size);
+  return true;
+}
+
+bool session::save_state(const string &path) {
+  make_dirs(path.substr(0, path.rfind('/')));
+  string tmp_path = path + ".tmp";
+  ofstream out(tmp_path.c_str());
+  const char *path_env = getenv("PATH");
+  string current_path = path_env ? path_env : "";
+  out << STATE_MAGIC << endl;
+  out << "path\t" << current_path << "\t" << path_dir_stamps(current_path)
+      << endl;
+  if (hashed_path_env == current_path)
+    for (map<string, hashed_command>::iterator it = command_hash.begin();
+         it != command_hash.end(); it++)
+      out << "cmd\t" << it->second.uses << "\t" << it->second.dev << "\t"
+          << it->second.ino << "\t" << it->first << "\t" << it->second.path
+          << endl;
+  for (map<string, string>::iterator it = alias_map.begin();
+       it != alias_map.end(); it++)
+    out << "alias\t" << it->first << "\t" << it->second << endl;
+  int first = max(0, (int)cmd_history.size() - STATE_HISTORY);
+  for (int i = first; i < cmd_history.size(); i++)
+    out << "history\t" << cmd_history[i] << endl;
+  out.close();
+  return out.good() && rename(tmp_path.c_str(), path.c_str()) == 0;
+}
+
+// ==========================
+// line profile
+// set -o profile[=FILE] charges each line run with its wall time, the cpu
+// time of the children reaped meanwhile and the processes forked for it
+// lines of scripts are told apart by where they are, see source,
+// the others by their text
+// the lines are reported slowest first as the session ends,
+// to FILE or else stderr
+// ==========================
+void session::profile_line(const string &line, double begin,
+                           const rusage &children_before,
+                           unsigned forks_before) {
+  double wall = now_seconds() - begin;
+  rusage children;
+  getrusage(RUSAGE_CHILDREN, &children);
+  line_profile &entry = profile[source.empty() ? line : source];
+  entry.line = line;
+  entry.runs++;
+  entry.wall += wall;
+  entry.cpu += children.ru_utime.tv_sec - children_before.ru_utime.tv_sec +
+               children.ru_stime.tv_sec - children_before.ru_stime.tv_sec +
+               (children.ru_utime.tv_usec - children_before.ru_utime.tv_usec +
+                children.ru_stime.tv_usec - children_before.ru_stime.tv_usec) /
+                   1e6;
+  entry.processes += *fork_count - forks_before;
+}
+
+bool slower_line(const pair<string, line_profile> &a,
+                 const pair<string, line_profile> &b) {
+  return a.second.wall > b.second.wall;
+}
+
+void session::report_profile() {
+  vector<pair<string, line_profile> > lines(profile.begin(), profile.end());
+  sort(lines.begin(), lines.end(), slower_line);
+  double wall = 0, cpu = 0;
+  long processes = 0;
+  for (int i = 0; i < lines.size(); i++) {
+    wall += lines[i].second.wall;
+    cpu += lines[i].second.cpu;
+    processes += lines[i].second.processes;
+  }
+  string path = shell_options["profile"];
+  ofstream file;
+  if (!path.empty())
+    file.open(path.c_str());
+  ostream &out = path.empty() ? cerr : file;
+  char buf[CHAR_BUF_SIZE];
+  sprintf(buf, "profile: %d lines, %.3fs wall, %.3fs cpu, %ld processes",
+          (int)lines.size(), wall, cpu, processes);
+  out << buf << endl;
+  sprintf(buf, "%10s %10s %6s %5s  %s", "wall ms", "cpu ms", "procs", "runs",
+          "line");
+  out << buf << endl;
+  for (int i = 0; i < lines.size(); i++) {
+    line_profile &entry = lines[i].second;
+    sprintf(buf, "%10.3f %10.3f %6ld %5ld  ", entry.wall * 1e3,
+            entry.cpu * 1e3, entry.processes, entry.runs);
+    out << buf
+        << (lines[i].first == entry.line ? "" : lines[i].first + "  ")
+        << entry.line << endl;
+  }
+}
+
+// run the command line in foreground and wait for it
+// jobs exiting meanwhile are reaped too, so they give back their tokens
+// resource usage of the child is stored to usage if given
+int session::run_line(string line, rusage *usage) {
+  int pid = spawn_line(line);
+  int wait_status;
+  rusage child_usage;
+  if (!job_table.empty())
+    wait_beside_jobs(pid);
+  while (wait_traced(pid, &wait_status, 0, &child_usage) < 0 && errno == EINTR)
+    ;
+  if (usage)
+    *usage = child_usage;
+  check_wait_status(wait_status);
+  return wait_status;
+}
+
+// ==========================
+// session
+// ==========================
+session::session() {
+  finished = false;
+  pipe_meter = false;
+  stage_counters = NULL;
+  pipe_index = 0;
+  stdin_given = false;
+  jobserver_fd[0] = jobserver_fd[1] = jobserver_try_fd = -1;
+  implicit_token_lent = false;
+  agent_turn = NULL;
+  pin_turn = NULL;
+  pin_base = 0;
+  hash_clock = 0;
+  loaded_state = false;
+  keep_history = true;
+  exec_last = false;
+  alias_loaded = false; // home_dir and aliases are looked up when first needed
+  char buf[CHAR_BUF_SIZE];
+  if (getcwd(buf, CHAR_BUF_SIZE) != NULL)
+    cwd = buf;
+}
+
+session::~session() {
+  if (option_on("state"))
+    save_state(state_path());
+  if (!profile.empty())
+    report_profile();
+  if (option_on("trace"))
+    finish_trace(shell_options["trace"]);
+  close_jobserver();
+  forget_commands();
+  if (agent_turn != NULL)
+    munmap(agent_turn, sizeof(unsigned));
+  if (pin_turn != NULL)
+    munmap(pin_turn, sizeof(unsigned));
+}
+
+// home path (~), looked up on first use as it may take an NSS lookup
+const string &session::home() {
+  if (!home_dir.empty())
+    return home_dir;
+  passwd *pwd = getpwuid(getuid());
+  string username(pwd ? pwd->pw_name : "");
+  if (username == "root")
+    home_dir = "/root"; // home for root
+  else
+    home_dir = "/home/" + username; // home for other user
+  return home_dir;
+}
+
+// variables set by the session, like those of read and set -o jobs,
+// live in env_vars; they are put into the process environment only while
+// a line of the session runs and in its children, so sessions sharing a
+// process do not see each other's
+void session::set_env(const string &name, const string &value) {
+  env_vars[name] = value;
+  setenv(name.c_str(), value.c_str(), 1);
+}
+
+void session::unset_env(const string &name) {
+  env_vars.erase(name);
+  unsetenv(name.c_str());
+}
+
+void session::apply_env() {
+  for (map<string, string>::iterator it = env_vars.begin();
+       it != env_vars.end(); it++)
+    setenv(it->first.c_str(), it->second.c_str(), 1);
+}
+
+vector<string> save_environ() {
+  vector<string> saved;
+  for (char **env = environ; *env != NULL; env++)
+    saved.push_back(*env);
+  return saved;
+}
+
+void restore_environ(const vector<string> &saved) {
+  clearenv();
+  for (int i = 0; i < saved.size(); i++) {
+    int eq = saved[i].find('=');
+    setenv(saved[i].substr(0, eq).c_str(), saved[i].substr(eq + 1).c_str(),
+           1);
+  }
+}
+
+// command alias
+// modify this function to add more aliases
+void session::init_alias() {
+  alias_map.insert(pair<string, string>("ll", "ls -l"));
+  alias_loaded = true;
+}
+
+bool session::option_on(const string &name) {
+  return shell_options.count(name) != 0;
+}
+
+// whether options have something to write as the session ends,
+// then the last command of a line must not replace the process
+bool session::reports_at_exit() {
+  return option_on("profile") || option_on("trace") || option_on("state");
+}
+
+// whether builtin stages are asked to use io_uring, see stage_io
+bool session::uring_io() {
+  return option_on("io") && shell_options["io"] == "uring";
+}
+
+// ==========================
+// lastpipe
+// a builtin as the last stage of a pipeline runs in the shell itself,
+// so producer | read x sets x for the session, without a process for it
+// ==========================
+// index of the | before the last stage of a pipeline, -1 if none
+int last_pipe(const string &line) {
+  int pipe_at = -1;
+  bool quoted = false;
+  for (int i = 0; i < line.length(); i++) {
+    int end;
+    if (line[i] == '\"')
+      quoted = !quoted;
+    else if (quoted)
+      continue;
+    else if (opens_group(line, i) && (end = group_end(line, i)) > 0)
+      i = end;
+    else if (line[i] == '|')
+      pipe_at = i;
+  }
+  return pipe_at;
+}
+
+bool session::run_lastpipe(const string &line, int &status) {
+  int pipe_at = last_pipe(line);
+  if (pipe_at < 0)
+    return false;
+  string stage = trim(line.substr(pipe_at + 1));
+  if (stage.empty() || !is_builtin(string_split_first(stage, WHITE_SPACE)))
+    return false;
+  int pipe_fd[2];
+  pipe_wrap(pipe_fd);
+  int pid = fork_wrap();
+  if (pid == 0) { // the stages before, as a child
+    close(pipe_fd[0]);
+    dup2_wrap(pipe_fd[1], fileno(stdout));
+    close(pipe_fd[1]);
+    exit(exec_line(trim(line.substr(0, pipe_at))));
+  }
+  int saved_stdin = dup(fileno(stdin));
+  close(pipe_fd[1]);
+  dup2_wrap(pipe_fd[0], fileno(stdin));
+  close(pipe_fd[0]);
+  status = builtin_exit_code(process_builtin_command(stage));
+  cout.flush();
+  dup2_wrap(saved_stdin, fileno(stdin));
+  close(saved_stdin);
+  int wait_status;
+  wait_traced(pid, &wait_status, 0);
+  return true;
+}
+
+// ==========================
+// subshells in the shell itself
+// most subshells only scope a cd or a set, so unless the list has to run
+// in its own process, it runs in the session and the state is restored
+// ==========================
+// whether the list of a subshell needs a process of its own:
+// it quits, starts background jobs which must not become ours, or changes
+// the command hash, which holds open files and is not restored
+bool forks_subshell(const string &body) {
+  vector<string> ops;
+  vector<string> commands = split_list(body, ops);
+  for (int i = 0; i < commands.size(); i++) {
+    string inner;
+    bool subshell;
+    if (is_group(commands[i], inner, subshell) && forks_subshell(inner))
+      return true;
+    if (commands[i] == "quit" || commands[i][commands[i].length() - 1] == '&')
+      return true;
+    if (string_split_first(commands[i], WHITE_SPACE) == "hash")
+      return true;
+  }
+  return false;
+}
+
+// what a list can change in the session
+struct shell_state {
+  string cwd;
+  map<string, string> shell_options;
+  vector<string> environment;
+  map<string, string> env_vars;
+};
+
+int session::run_subshell(const string &body, rusage &usage) {
+  shell_state saved;
+  char buf[CHAR_BUF_SIZE];
+  if (getcwd(buf, CHAR_BUF_SIZE) != NULL)
+    saved.cwd = buf;
+  saved.shell_options = shell_options;
+  saved.environment = save_environ();
+  saved.env_vars = env_vars;
+  int status = execute_line(body, usage);
+  // restore, with the side effects of options undone
+  chdir(saved.cwd.c_str());
+  // a trace or state file of the list's own is written as the list ends
+  string trace_now = option_on("trace") ? shell_options["trace"] : "";
+  string trace_saved = saved.shell_options.count("trace") != 0
+                           ? saved.shell_options["trace"]
+                           : "";
+  if (trace_now != trace_saved) {
+    if (!trace_now.empty())
+      finish_trace(trace_now);
+    if (!trace_saved.empty())
+      start_trace();
+  }
+  bool state_saved = saved.shell_options.count("state") != 0;
+  if (option_on("state") &&
+      (!state_saved || saved.shell_options["state"] != shell_options["state"]))
+    save_state(state_path());
+  string jobs_now = shell_options.count("jobs") ? shell_options["jobs"] : "";
+  string jobs_saved = saved.shell_options.count("jobs") != 0
+                          ? saved.shell_options["jobs"]
+                          : "";
+  if (jobs_now != jobs_saved) {
+    close_jobserver();
+    if (!jobs_saved.empty())
+      init_jobserver(atoi(jobs_saved.c_str()));
+  }
+  shell_options = saved.shell_options;
+  restore_environ(saved.environment);
+  env_vars = saved.env_vars;
+  return status;
+}
+
+// what the line does in the session itself: background jobs, builtins,
+// incremental skipping, and otherwise running it in foreground
+// returns the exit code
+// with tail, the session is done after the line, see exec_line
+int session::execute_line(string line, rusage &usage, bool tail) {
+  if (line.empty())
+    return 0;
+  // background job, the whole list goes to background
+  if (line.length() > 1 && line[line.length() - 1] == '&') {
+    queue_job(trim(line.substr(0, line.length() - 1)));
+    return 0;
+  }
+  vector<string> ops;
+  vector<string> commands = split_list(line, ops);
+  if (commands.size() > 1) {
+    int status = 0;
+    for (int i = 0; i < commands.size(); i++)
+      if (i == 0 || list_continues(ops[i - 1], status))
+        status = execute_line(commands[i], usage,
+                              tail && i + 1 == commands.size());
+    return status;
+  }
+  line = commands[0]; // without a trailing ;
+  string body;
+  bool subshell;
+  if (is_group(line, body, subshell)) {
+    if (!subshell || tail) // nothing to restore
+      return execute_line(body, usage, tail);
+    if (!forks_subshell(body))
+      return run_subshell(body, usage);
+  }
+  // deal with builtin commands
+  int builtin_ret = process_builtin_command(line);
+  if (builtin_ret != 0)
+    return builtin_exit_code(builtin_ret);
+  int lastpipe_status;
+  if (run_lastpipe(line, lastpipe_status))
+    return lastpipe_status;
+  hash_t fingerprint;
+  bool up_to_date = false;
+  bool fingerprinted = option_on("incremental") &&
+                       fingerprint_line(line, fingerprint, up_to_date);
+  if (up_to_date) {
+    cout << "[incremental] skip: " << line << endl;
+    return 0;
+  }
+  hash_line(line);
+  if (tail && !fingerprinted && job_table.empty() && !reports_at_exit())
+    exit(exec_line(line));
+  int wait_status = run_line(line, &usage);
+  if (fingerprinted && WIFEXITED(wait_status) && WEXITSTATUS(wait_status) == 0)
+    record_fingerprint(line, fingerprint);
+  return exit_code(wait_status);
+}
+
+// an anonymous file to capture output into
+int capture_file() {
+  int fd = memfd_create("expshell-capture", MFD_CLOEXEC);
+  if (fd < 0) // no memfd, fall back to an unlinked temporary file
+    fd = dup(fileno(tmpfile()));
+  return fd;
+}
+
+string read_capture(int fd) {
+  string captured;
+  char buf[STAGE_CHUNK_SIZE];
+  ssize_t n;
+  lseek(fd, 0, SEEK_SET);
+  while ((n = read(fd, buf, sizeof(buf))) > 0)
+    captured.append(buf, n);
+  close(fd);
+  return captured;
+}
+
+run_result session::run(const string &line, const io_spec &io) {
+  run_result result;
+  memset(&result.usage, 0, sizeof(result.usage));
+  string line_ = trim(line);
+  if (keep_history)
+    cmd_history.push_back(line_);
+  // sessions sharing a process each have their own working directory
+  // and variables, the environment of the process is back after the line
+  if (!cwd.empty())
+    chdir(cwd.c_str());
+  vector<string> host_environ = save_environ();
+  apply_env();
+  // point stdin, stdout and stderr to what io asks for while the line runs,
+  // builtins write to them in the session and children inherit them
+  int target[3] = {io.in_fd, io.out_fd, io.err_fd};
+  if (io.capture) {
+    target[1] = capture_file();
+    target[2] = capture_file();
+  }
+  int saved[3] = {-1, -1, -1};
+  cout.flush();
+  for (int fd = 0; fd < 3; fd++)
+    if (target[fd] >= 0) {
+      saved[fd] = dup(fd);
+      dup2_wrap(target[fd], fd);
+    }
+  // what the line costs, for set -o profile, which the line may turn on
+  double begin = now_seconds();
+  rusage children;
+  getrusage(RUSAGE_CHILDREN, &children);
+  unsigned forks = fork_count ? *fork_count : 0;
+  result.status = execute_line(line_, result.usage, exec_last);
+  if (option_on("profile"))
+    profile_line(line_, begin, children, forks);
+  cout.flush();
+  char buf[CHAR_BUF_SIZE];
+  if (getcwd(buf, CHAR_BUF_SIZE) != NULL)
+    cwd = buf;
+  for (int fd = 0; fd < 3; fd++)
+    if (saved[fd] >= 0) {
+      dup2_wrap(saved[fd], fd);
+      close(saved[fd]);
+    }
+  if (io.capture) {
+    result.output = read_capture(target[1]);
+    result.error = read_capture(target[2]);
+  }
+  restore_environ(host_environ);
+  return result;
+}
+
+// whether the line only changes the state of the session and returns at
+// once, so a server can run it in its own process
+// anything that runs commands, waits or reads stdin goes to a child,
+// as do lists, pipes and redirects, even of those builtins
+bool runs_in_session(const string &line) {
+  if (line.empty() || line[line.length() - 1] == '&')
+    return true; // a background job is only queued
+  vector<string> ops;
+  if (split_list(line, ops).size() != 1 ||
+      line.find_first_of("|<>") != string::npos)
+    return false;
+  vector<string> argv = string_split(line, WHITE_SPACE);
+  const char *state_builtins[] = {"cd", "quit", "history", "set", "jobs",
+                                  "hash"};
+  for (int i = 0; i < sizeof(state_builtins) / sizeof(state_builtins[0]); i++)
+    if (argv[0] == state_builtins[i])
+      return argv[0] != "jobs" || argv.size() == 1 || argv[1] != "-t";
+  return false;
+}
+
+// start a line in foreground without waiting for it
+// stdin, stdout and stderr of the child are set to fds
+int session::spawn_line_io(const string &line, const int fds[3]) {
+  if (keep_history)
+    cmd_history.push_back(line);
+  int pid = fork_wrap();
+  if (pid == 0) {
+    setpgid(0, 0);
+    signal(SIGPIPE, SIG_DFL); // ignored by the server
+    if (!cwd.empty())
+      chdir(cwd.c_str());
+    apply_env();
+    for (int fd = 0; fd < 3; fd++)
+      dup2_wrap(fds[fd], fd);
+    exit(exec_line(line)); // child exit
+  }
+  setpgid(pid, pid);
+  return pid;
+}
+
+
+// ==========================
+// server mode
+// one process hosts a session for each client of a unix socket
+// ==========================
+// every message is a SOCK_SEQPACKET packet: a type byte, then the payload
+#define FRAME_RUN 'R'    // client: run the payload as a command line, may carry
+                         // its stdin, stdout and stderr as SCM_RIGHTS
+#define FRAME_STDIN 'I'  // client: input of a line run without fds,
+                         // empty at the end of input
+#define FRAME_LOAD 'L'   // client: ask / server: lines running and queued
+#define FRAME_STDOUT 'O' // server: output of a line run without fds
+#define FRAME_STDERR 'E' // server: error output of a line run without fds
+#define FRAME_EXIT 'X'   // server: the line is done, payload is its exit code
+#define FRAME_MAX 65536
+#define SERVER_BACKLOG 64
+#define SERVER_TICK_MS 200 // how often background jobs are reaped
+
+bool send_frame(int sock, char type, const string &payload,
+                const int *fds = NULL, int nfds = 0) {
+  string packet = type + payload;
+  iovec iov;
+  iov.iov_base = &packet[0];
+  iov.iov_len = packet.length();
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  char control[CMSG_SPACE(3 * sizeof(int))];
+  if (nfds > 0) {
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+  }
+  return sendmsg(sock, &msg, MSG_NOSIGNAL) == packet.length();
+}
+
+// send a whole captured output in frames
+bool send_output(int sock, char type, const string &output) {
+  for (int p = 0; p < output.length(); p += FRAME_MAX)
+    if (!send_frame(sock, type, output.substr(p, FRAME_MAX)))
+      return false;
+  return true;
+}
+
+// receive a frame, fds passed along are stored to fds (up to 3)
+// returns false on error or when the peer is gone
+bool recv_frame(int sock, char &type, string &payload, int *fds, int &nfds,
+                int flags = 0) {
+  char buf[FRAME_MAX + 1];
+  iovec iov;
+  iov.iov_base = buf;
+  iov.iov_len = sizeof(buf);
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  char control[CMSG_SPACE(3 * sizeof(int))];
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  nfds = 0;
+  type = 0;
+  ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC | flags);
+  if (n < 0 && errno == EAGAIN)
+    return true; // nothing yet, type is 0
+  if (n <= 0)
+    return false;
+  for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+       cmsg = CMSG_NXTHDR(&msg, cmsg))
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+    }
+  type = buf[0];
+  payload.assign(buf + 1, n - 1);
+  return true;
+}
+
+int connect_socket(const string &socket_path) {
+  int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+  if (sock >= 0 && connect(sock, (sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+struct server_request {
+  string line;
+  int fds[3]; // stdin, stdout, stderr passed by the client, or -1
+};
+
+// a connected client and the session hosted for it
+struct server_client {
+  session *shell;
+  int pid; // line running on behalf of it, 0 if idle
+  int pid_fd;
+  bool exited;
+  int wait_status;
+  int fds[3];    // passed by the client for the running line
+  int stream[3]; // our ends of pipes to the line if no fds were passed
+  string input;  // from the client, not yet written to stream[0]
+  bool input_ended;
+  vector<server_request> queue;
+};
+
+// the epoll loop and what it is waiting for
+struct server_state {
+  int epoll_fd;
+  map<int, server_client> clients; // by socket
+  map<int, int> fd_owner; // pidfds and stream pipes -> socket of the client
+};
+
+void close_request_fds(int fds[3]) {
+  for (int fd = 0; fd < 3; fd++)
+    if (fds[fd] >= 0)
+      close(fds[fd]);
+}
+
+void server_watch(server_state &server, int sock, int fd, int events) {
+  epoll_event event;
+  event.events = events;
+  event.data.fd = fd;
+  epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, fd, &event);
+  server.fd_owner[fd] = sock;
+}
+
+// stop watching and close one of the fds of a running line
+void server_close(server_state &server, int &fd) {
+  if (fd < 0)
+    return;
+  server.fd_owner.erase(fd);
+  close(fd); // also leaves the epoll set
+  fd = -1;
+}
+
+// write what the client sent so far to the stdin of the line
+void server_feed(server_state &server, int sock, server_client &client) {
+  while (!client.input.empty()) {
+    ssize_t n = write(client.stream[0], client.input.c_str(),
+                      client.input.length());
+    if (n < 0 && errno == EAGAIN)
+      break;
+    if (n < 0) { // the line no longer reads its stdin
+      client.input.clear();
+      client.input_ended = true;
+      break;
+    }
+    client.input.erase(0, n);
+  }
+  bool watched = server.fd_owner.count(client.stream[0]) != 0;
+  if (client.input.empty() && client.input_ended)
+    server_close(server, client.stream[0]);
+  else if (client.input.empty() && watched) {
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_DEL, client.stream[0], NULL);
+    server.fd_owner.erase(client.stream[0]);
+  } else if (!client.input.empty() && !watched)
+    server_watch(server, sock, client.stream[0], EPOLLOUT);
+}
+
+void server_start_next(server_state &server, int sock, server_client &client);
+
+// the line has exited and its output is drained, report it
+void server_try_finish(server_state &server, int sock, server_client &client) {
+  if (client.pid == 0 || !client.exited || client.stream[1] >= 0 ||
+      client.stream[2] >= 0)
+    return;
+  client.pid = 0;
+  server_close(server, client.pid_fd);
+  server_close(server, client.stream[0]);
+  close_request_fds(client.fds);
+  char code[16];
+  sprintf(code, "%d", exit_code(client.wait_status));
+  send_frame(sock, FRAME_EXIT, code);
+  server_start_next(server, sock, client);
+}
+
+// start what the client asked for next, unless a line is running already
+void server_start_next(server_state &server, int sock, server_client &client) {
+  while (client.pid == 0 && !client.queue.empty()) {
+    server_request request = client.queue.front();
+    client.queue.erase(client.queue.begin());
+    if (request.fds[0] < 0)
+      request.fds[0] = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (runs_in_session(trim(request.line))) {
+      io_spec io;
+      io.in_fd = request.fds[0];
+      io.out_fd = request.fds[1];
+      io.err_fd = request.fds[2];
+      io.capture = request.fds[1] < 0;
+      run_result result = client.shell->run(request.line, io);
+      close_request_fds(request.fds);
+      char code[16];
+      sprintf(code, "%d", result.status);
+      send_output(sock, FRAME_STDOUT, result.output);
+      send_output(sock, FRAME_STDERR, result.error);
+      send_frame(sock, FRAME_EXIT, code);
+      continue;
+    }
+    for (int fd = 0; fd < 3; fd++) {
+      client.fds[fd] = request.fds[fd];
+      client.stream[fd] = -1;
+    }
+    client.input.clear();
+    client.input_ended = false;
+    if (client.fds[1] < 0) { // stream stdin, stdout and stderr over the socket
+      close(client.fds[0]);
+      for (int fd = 0; fd < 3; fd++) {
+        int pipe_fd[2];
+        if (pipe2(pipe_fd, O_CLOEXEC) < 0)
+          panic("pipe failed", true, 1);
+        client.fds[fd] = pipe_fd[fd == 0 ? 0 : 1];
+        client.stream[fd] = pipe_fd[fd == 0 ? 1 : 0];
+        fcntl(client.stream[fd], F_SETFL, O_NONBLOCK);
+      }
+    }
+    client.pid = client.shell->spawn_line_io(trim(request.line), client.fds);
+    close_request_fds(client.fds); // the child has them now
+    client.exited = false;
+    client.pid_fd = -1;
+#ifdef SYS_pidfd_open
+    client.pid_fd = syscall(SYS_pidfd_open, client.pid, 0);
+#endif
+    for (int fd = 1; fd < 3; fd++)
+      if (client.stream[fd] >= 0)
+        server_watch(server, sock, client.stream[fd], EPOLLIN);
+    if (client.pid_fd >= 0) {
+      server_watch(server, sock, client.pid_fd, EPOLLIN);
+      continue;
+    }
+    // no pidfd, wait for it right away
+    for (int fd = 1; fd < 3; fd++)
+      server_close(server, client.stream[fd]);
+    wait_traced(client.pid, &client.wait_status, 0);
+    client.exited = true;
+    server_try_finish(server, sock, client);
+  }
+}
+
+// something happened to the line running for a client
+void server_line_event(server_state &server, int fd) {
+  int sock = server.fd_owner[fd];
+  server_client &client = server.clients[sock];
+  if (fd == client.pid_fd) {
+    if (wait_traced(client.pid, &client.wait_status, WNOHANG) == 0)
+      return; // stale event of a closed fd
+    client.exited = true;
+    server_close(server, client.pid_fd);
+  } else if (fd == client.stream[0])
+    server_feed(server, sock, client);
+  else {
+    char buf[FRAME_MAX];
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n > 0)
+      send_frame(sock, fd == client.stream[1] ? FRAME_STDOUT : FRAME_STDERR,
+                 string(buf, n));
+    else if (n == 0 || errno != EAGAIN)
+      server_close(server, fd == client.stream[1] ? client.stream[1]
+                                                  : client.stream[2]);
+  }
+  server_try_finish(server, sock, client);
+}
+
+// the client is gone, so is its session and whatever it was running
+void server_drop(server_state &server, int sock) {
+  server_client &client = server.clients[sock];
+  if (client.pid > 0) {
+    kill(-client.pid, SIGKILL);
+    if (!client.exited)
+      wait_traced(client.pid, &client.wait_status, 0);
+    server_close(server, client.pid_fd);
+    for (int fd = 0; fd < 3; fd++)
+      server_close(server, client.stream[fd]);
+  }
+  for (int i = 0; i < client.queue.size(); i++)
+    close_request_fds(client.queue[i].fds);
+  delete client.shell;
+  close(sock);
+  server.clients.erase(sock);
+}
+
+// lines running and queued on the server
+int server_load(server_state &server) {
+  int load = 0;
+  for (map<int, server_client>::iterator it = server.clients.begin();
+       it != server.clients.end(); it++)
+    load += it->second.queue.size() + (it->second.pid != 0 ? 1 : 0) +
+            it->second.shell->job_table.size();
+  return load;
+}
+
+// a frame from a client
+void server_client_event(server_state &server, int sock) {
+  server_client &client = server.clients[sock];
+  char type;
+  server_request request;
+  int nfds;
+  // events of a closed fd may still be in the batch, do not block
+  if (!recv_frame(sock, type, request.line, request.fds, nfds, MSG_DONTWAIT)) {
+    server_drop(server, sock);
+    return;
+  }
+  for (int k = nfds; k < 3; k++)
+    request.fds[k] = -1;
+  if (type == FRAME_RUN) {
+    client.queue.push_back(request);
+    server_start_next(server, sock, client);
+  } else {
+    close_request_fds(request.fds);
+    if (type == FRAME_STDIN && client.stream[0] >= 0) {
+      client.input += request.line;
+      client.input_ended = request.line.empty();
+      server_feed(server, sock, client);
+    } else if (type == FRAME_LOAD) {
+      char load[16];
+      sprintf(load, "%d", server_load(server));
+      send_frame(sock, FRAME_LOAD, load);
+    }
+  }
+  if (client.shell->finished) // `quit`
+    server_drop(server, sock);
+}
+
+int serve_sessions(const string &socket_path) {
+  int listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+  // a socket left by an earlier server is replaced, anything else is kept
+  struct stat st;
+  if (lstat(socket_path.c_str(), &st) == 0) {
+    if (!S_ISSOCK(st.st_mode))
+      panic("server: " + socket_path + " exists and is not a socket", true, 1);
+    unlink(socket_path.c_str());
+  }
+  if (listen_fd < 0 || bind(listen_fd, (sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(listen_fd, SERVER_BACKLOG) < 0)
+    panic("server: cannot listen on " + socket_path, true, 1);
+  signal(SIGPIPE, SIG_IGN); // clients and lines may go away any time
+  // every session starts where the server was started
+  char start_dir[CHAR_BUF_SIZE];
+  if (getcwd(start_dir, CHAR_BUF_SIZE) == NULL)
+    strcpy(start_dir, "/");
+  server_state server;
+  server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  epoll_event event;
+  event.events = EPOLLIN;
+  event.data.fd = listen_fd;
+  epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+  while (true) {
+    epoll_event events[SERVER_BACKLOG];
+    int n = epoll_wait(server.epoll_fd, events, SERVER_BACKLOG, SERVER_TICK_MS);
+    for (int i = 0; i < n; i++) {
+      int fd = events[i].data.fd;
+      if (fd == listen_fd) {
+        int sock = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (sock < 0)
+          continue;
+        server_client &client = server.clients[sock];
+        client.shell = new session();
+        client.shell->cwd = start_dir;
+        client.pid = 0;
+        client.pid_fd = -1;
+        for (int k = 0; k < 3; k++)
+          client.fds[k] = client.stream[k] = -1;
+        event.events = EPOLLIN;
+        event.data.fd = sock;
+        epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, sock, &event);
+      } else if (server.fd_owner.count(fd) != 0)
+        server_line_event(server, fd);
+      else if (server.clients.count(fd) != 0)
+        server_client_event(server, fd);
+    }
+    for (map<int, server_client>::iterator it = server.clients.begin();
+         it != server.clients.end(); it++) {
+      it->second.shell->reap_jobs();
+      it->second.shell->schedule_jobs();
+      it->second.shell->job_notices.clear();
+    }
+  }
+}
+
+// run a line on a server and wait for its exit code
+// with stream, our stdin, stdout and stderr are relayed over the socket,
+// otherwise they are passed to the server
+// returns -1 if the server is gone
+int run_on_server(int sock, const string &line, bool stream) {
+  int fds[3] = {fileno(stdin), fileno(stdout), fileno(stderr)};
+  if (!send_frame(sock, FRAME_RUN, line, fds, stream ? 0 : 3))
+    return -1;
+  pollfd pfd[2];
+  pfd[0].fd = sock;
+  pfd[0].events = POLLIN;
+  pfd[1].fd = fileno(stdin);
+  pfd[1].events = POLLIN;
+  int npfd = stream ? 2 : 1;
+  while (true) {
+    if (poll(pfd, npfd, -1) < 0 && errno != EINTR)
+      return -1;
+    if (npfd == 2 && (pfd[1].revents & (POLLIN | POLLHUP)) != 0) {
+      char buf[FRAME_MAX];
+      ssize_t n = read(pfd[1].fd, buf, sizeof(buf));
+      if (n <= 0) // end of input
+        npfd = 1;
+      send_frame(sock, FRAME_STDIN, string(buf, n > 0 ? n : 0));
+    }
+    if ((pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) == 0)
+      continue;
+    char type;
+    string payload;
+    int nfds;
+    if (!recv_frame(sock, type, payload, fds, nfds))
+      return -1;
+    if (type == FRAME_STDOUT)
+      write_all(fileno(stdout), payload.c_str(), payload.length());
+    else if (type == FRAME_STDERR)
+      write_all(fileno(stderr), payload.c_str(), payload.length());
+    else if (type == FRAME_EXIT)
+      return atoi(payload.c_str());
+  }
+}
+
+// run the lines of stdin on a server, passing our stdin, stdout and stderr
+// returns the exit code of the last line
+int connect_session(const string &socket_path) {
+  int sock = connect_socket(socket_path);
+  if (sock < 0)
+    panic("cannot connect to " + socket_path, true, 1);
+  int status = 0;
+  string line;
+  while (getline(cin, line)) {
+    int code = run_on_server(sock, line, false);
+    if (code < 0) // the server hangs up after `quit`
+      break;
+    status = code;
+  }
+  close(sock);
+  return status;
+}
+
+// ==========================
+// agent pool
+// `remote cmd` runs cmd on one of the servers (agents) whose sockets are
+// in the directory of `set -o agents=DIR`
+// ==========================
+// sockets in the agent directory, sorted by name
+vector<string> list_agents(const string &dir_path) {
+  vector<string> agents;
+  DIR *dir = opendir(dir_path.c_str());
+  if (dir == NULL)
+    return agents;
+  dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    struct stat st;
+    string path = dir_path + "/" + entry->d_name;
+    if (stat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+      agents.push_back(path);
+  }
+  closedir(dir);
+  sort(agents.begin(), agents.end());
+  return agents;
+}
+
+// lines running and queued on the agent, -1 if it does not answer
+int agent_load(const string &path) {
+  int sock = connect_socket(path);
+  char type;
+  string payload;
+  int fds[3], nfds;
+  int load = -1;
+  if (sock >= 0 && send_frame(sock, FRAME_LOAD, "") &&
+      recv_frame(sock, type, payload, fds, nfds) && type == FRAME_LOAD)
+    load = atoi(payload.c_str());
+  if (sock >= 0)
+    close(sock);
+  return load;
+}
+
+// connect to the agent to run the next line on, -1 if none is reachable
+// set -o agent_pick=load picks the least busy one, round robin otherwise
+int session::connect_agent() {
+  vector<string> agents = list_agents(shell_options["agents"]);
+  if (shell_options.count("agent_pick") != 0 &&
+      shell_options["agent_pick"] == "load") {
+    string best;
+    int best_load = -1;
+    for (int i = 0; i < agents.size(); i++) {
+      int load = agent_load(agents[i]);
+      if (load >= 0 && (best_load < 0 || load < best_load)) {
+        best = agents[i];
+        best_load = load;
+      }
+    }
+    return best_load < 0 ? -1 : connect_socket(best);
+  }
+  // the turn is shared with the other children of the shell
+  unsigned turn = agent_turn ? __sync_fetch_and_add(agent_turn, 1) : 0;
+  for (int i = 0; i < agents.size(); i++) {
+    int sock = connect_socket(agents[(turn + i) % agents.size()]);
+    if (sock >= 0)
+      return sock;
+  }
+  return -1;
+}
+
+// remote [-s] [-a agent] command...
+// -s relays stdin, stdout and stderr over the socket instead of passing them,
+// for agents that cannot open what we have open
+int session::builtin_remote(vector<string> &argv) {
+  bool stream = false;
+  string agent;
+  int i = 1;
+  for (; i < argv.size() && argv[i][0] == '-'; i++)
+    if (argv[i] == "-s")
+      stream = true;
+    else if (argv[i] == "-a" && i + 1 < argv.size())
+      agent = argv[++i];
+    else
+      break;
+  if (i >= argv.size() || shell_options.count("agents") == 0) {
+    panic("usage: remote [-s] [-a agent] command..., "
+          "with set -o agents=DIR");
+    return 2;
+  }
+  string line = argv_line(argv, i);
+  if (!agent.empty() && agent.find('/') == string::npos)
+    agent = shell_options["agents"] + "/" + agent;
+  int sock = agent.empty() ? connect_agent() : connect_socket(agent);
+  if (sock < 0 && !agent.empty()) // name without .sock
+    sock = connect_socket(agent + ".sock");
+  if (sock < 0) {
+    panic("remote: no agent to run on");
+    return 1;
+  }
+  int code = run_on_server(sock, trim(line), stream);
+  close(sock);
+  if (code < 0) {
+    panic("remote: agent is gone");
+    return 1;
+  }
+  return code;
+}
@@ -1,3 +1,7 @@
 # gcc 4.1.2 does not support c++11
 # damn it!
-g++ ExpShell.cpp -o ExpShell -g # -std=c++11 # -std=c++0x
\ No newline at end of file
+g++ -c LibExpShell.cpp -o LibExpShell.o -g # -std=c++11 # -std=c++0x
+ar rcs libexpshell.a LibExpShell.o
+# libstdc++ linked in saves the dynamic loader most of the startup time
+# drop -static-libstdc++ for gcc older than 4.5
+g++ ExpShell.cpp -o ExpShell -g -L. -lexpshell -static-libstdc++
@@ -0,0 +1,20 @@
+#include "ExpShell.h"
+#include <iostream>
+#include <string>
+using namespace std;
+// runs each argument as a command line on one session
+int main(int argc, char *argv[]) {
+  session shell;
+  io_spec io;
+  io.capture = true;
+  for (int i = 1; i < argc; i++) {
+    run_result result = shell.run(argv[i], io);
+    cout << "$ " << argv[i] << endl;
+    cout << result.output << result.error;
+    cout << "status " << result.status << ", user "
+         << result.usage.ru_utime.tv_sec * 1000 +
+                result.usage.ru_utime.tv_usec / 1000
+         << " ms" << endl;
+  }
+  return 0;
+}
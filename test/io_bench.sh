@@ -0,0 +1,15 @@
+# io backend benchmark: builtin stages with set -o io=rw and io=uring
+# usage: sh io_bench.sh [megabytes], from this directory after make.sh
+MB=${1:-256}
+DATA=/tmp/expshell_io_bench
+head -c ${MB}M /dev/zero > $DATA
+for IO in rw uring; do
+  for LINE in "tee -a /dev/null < $DATA > /dev/null" \
+              "cat $DATA | tee /dev/null | tee -a /dev/null /dev/null | cat > /dev/null"; do
+    START=$(date +%s%N)
+    ../ExpShell -c "set -o io=$IO; $LINE"
+    END=$(date +%s%N)
+    echo "io=$IO $LINE : $(( (END - START) / 1000000 )) ms"
+  done
+done
+rm -f $DATA
@@ -1,2 +1,3 @@
 g++ RepeatArgv.cpp -o RepeatArgv
 g++ RepeatStdin.cpp -o RepeatStdin
+g++ RunSession.cpp -o RunSession -I.. -L.. -lexpshell
@@ -0,0 +1,17 @@
+# startup benchmark: average wall time of `ExpShell -c true`
+# usage: sh startup_bench.sh [runs], from this directory after make.sh
+RUNS=${1:-200}
+bench() {
+  START=$(date +%s%N)
+  i=0
+  while [ $i -lt $RUNS ]; do
+    "$@" > /dev/null
+    i=$((i + 1))
+  done
+  END=$(date +%s%N)
+  echo "$* : $(( (END - START) / RUNS / 1000 )) us per run"
+}
+bench ../ExpShell -c true
+bench ../ExpShell -c ""
+bench sh -c true
+../ExpShell --startup-profile -c true